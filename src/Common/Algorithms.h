@@ -18,22 +18,153 @@
 
 namespace Common
 {
-	static void SolveTridiagonal( FTYPE *a, FTYPE *b, FTYPE *c, FTYPE *d, FTYPE *x, int num )
+	// the recurrence runs in real: the modified coefficients go to cw, dw and the back substitution
+	// carries x in real, so FTYPE data can be factored in double; real = FTYPE with cw = c, dw = d works in place
+	template <typename real>
+	static void SolveTridiagonal( FTYPE *a, FTYPE *b, FTYPE *c, FTYPE *d, FTYPE *x, int num, real *cw, real *dw )
 	{
 		c[num-1] = 0.0;
 		
-		c[0] = c[0] / b[0];
-		d[0] = d[0] / b[0];
+		cw[0] = c[0] / (real)b[0];
+		dw[0] = d[0] / (real)b[0];
 
 		for (int i = 1; i < num; i++)
 		{
-			c[i] = c[i] / (b[i] - a[i] * c[i-1]);
-			d[i] = (d[i] - d[i-1] * a[i]) / (b[i] - a[i] * c[i-1]);  
+			cw[i] = c[i] / (b[i] - a[i] * cw[i-1]);
+			dw[i] = (d[i] - dw[i-1] * a[i]) / (b[i] - a[i] * cw[i-1]);  
 		}
 
-		x[num-1] = d[num-1];
+		real xi = dw[num-1];
+		x[num-1] = (FTYPE)xi;
 	
 		for (int i = num-2; i >= 0; i--)
-			x[i] = d[i] - c[i] * x[i+1];
+		{
+			xi = dw[i] - cw[i] * xi;
+			x[i] = (FTYPE)xi;
+		}
+	}
+
+	static void SolveTridiagonal( FTYPE *a, FTYPE *b, FTYPE *c, FTYPE *d, FTYPE *x, int num )
+	{
+		SolveTridiagonal<FTYPE>(a, b, c, d, x, num, c, d);
+	}
+
+	// solves nrhs systems sharing the same matrix: the matrix is factored once
+	// and every right-hand side d[r] is substituted into its own solution x[r]
+	template <typename real>
+	static void SolveTridiagonal( FTYPE *a, FTYPE *b, FTYPE *c, FTYPE **d, FTYPE **x, int num, int nrhs, real *cw, real **dw )
+	{
+		c[num-1] = 0.0;
+
+		for (int r = 0; r < nrhs; r++)
+			dw[r][0] = d[r][0] / (real)b[0];
+		cw[0] = c[0] / (real)b[0];
+
+		for (int i = 1; i < num; i++)
+		{
+			real m = b[i] - a[i] * cw[i-1];
+			cw[i] = c[i] / m;
+			for (int r = 0; r < nrhs; r++)
+				dw[r][i] = (d[r][i] - dw[r][i-1] * a[i]) / m;
+		}
+
+		for (int r = 0; r < nrhs; r++)
+		{
+			real xi = dw[r][num-1];
+			x[r][num-1] = (FTYPE)xi;
+			for (int i = num-2; i >= 0; i--)
+			{
+				xi = dw[r][i] - cw[i] * xi;
+				x[r][i] = (FTYPE)xi;
+			}
+		}
+	}
+
+	static void SolveTridiagonal( FTYPE *a, FTYPE *b, FTYPE *c, FTYPE **d, FTYPE **x, int num, int nrhs )
+	{
+		SolveTridiagonal<FTYPE>(a, b, c, d, x, num, nrhs, c, d);
+	}
+
+	// solves lanes independent systems in lockstep, element i of system l is stored at [i * lanes + l]:
+	// the inner loops run over systems, so the compiler can map them onto vector registers;
+	// every system must have c = 0 in its last row, shorter ones are padded with rows a = c = d = 0, b = 1
+	template <int lanes, typename real>
+	static void SolveTridiagonalBatch( FTYPE *a, FTYPE *b, FTYPE *c, FTYPE **d, FTYPE **x, int num, int nrhs, real *cw, real **dw )
+	{
+		real m[lanes];
+
+		for (int l = 0; l < lanes; l++)
+			m[l] = b[l];
+		for (int l = 0; l < lanes; l++)
+			cw[l] = c[l] / m[l];
+		for (int r = 0; r < nrhs; r++)
+			for (int l = 0; l < lanes; l++)
+				dw[r][l] = d[r][l] / m[l];
+
+		for (int i = 1; i < num; i++)
+		{
+			FTYPE *ai = a + i * lanes;
+			FTYPE *ci = c + i * lanes;
+			real *cwi = cw + i * lanes;
+			for (int l = 0; l < lanes; l++)
+			{
+				m[l] = b[i * lanes + l] - ai[l] * cwi[l - lanes];
+				cwi[l] = ci[l] / m[l];
+			}
+			for (int r = 0; r < nrhs; r++)
+			{
+				FTYPE *di = d[r] + i * lanes;
+				real *dwi = dw[r] + i * lanes;
+				for (int l = 0; l < lanes; l++)
+					dwi[l] = (di[l] - dwi[l - lanes] * ai[l]) / m[l];
+			}
+		}
+
+		for (int r = 0; r < nrhs; r++)
+		{
+			real xl[lanes];
+			for (int l = 0; l < lanes; l++)
+			{
+				xl[l] = dw[r][(num-1) * lanes + l];
+				x[r][(num-1) * lanes + l] = (FTYPE)xl[l];
+			}
+			for (int i = num-2; i >= 0; i--)
+				for (int l = 0; l < lanes; l++)
+				{
+					xl[l] = dw[r][i * lanes + l] - cw[i * lanes + l] * xl[l];
+					x[r][i * lanes + l] = (FTYPE)xl[l];
+				}
+		}
+	}
+
+	template <int lanes>
+	static void SolveTridiagonalBatch( FTYPE *a, FTYPE *b, FTYPE *c, FTYPE **d, FTYPE **x, int num, int nrhs )
+	{
+		SolveTridiagonalBatch<lanes, FTYPE>(a, b, c, d, x, num, nrhs, c, d);
+	}
+
+	// banded Gaussian elimination without pivoting, A(i, j) is stored at band[i * 5 + 2 + j - i] for |j - i| <= 2;
+	// meant for small diagonally dominant systems, the band and the right-hand sides d[r] are overwritten
+	static void SolvePentadiagonal( FTYPE *band, FTYPE **d, int num, int nrhs )
+	{
+		for (int i = 0; i < num; i++)
+			for (int row = i+1; row <= min(i+2, num-1); row++)
+			{
+				FTYPE f = band[row * 5 + 2 + i - row] / band[i * 5 + 2];
+				if (f == 0) continue;
+				for (int j = i; j <= min(i+2, num-1); j++)
+					band[row * 5 + 2 + j - row] -= f * band[i * 5 + 2 + j - i];
+				for (int r = 0; r < nrhs; r++)
+					d[r][row] -= f * d[r][i];
+			}
+
+		for (int r = 0; r < nrhs; r++)
+			for (int i = num-1; i >= 0; i--)
+			{
+				FTYPE sum = d[r][i];
+				for (int j = i+1; j <= min(i+2, num-1); j++)
+					sum -= band[i * 5 + 2 + j - i] * d[r][j];
+				d[r][i] = sum / band[i * 5 + 2];
+			}
 	}
 }
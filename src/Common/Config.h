@@ -61,17 +61,22 @@ namespace Common
 		static double R_specific, k, cv, baseT;		 
 
 		// time params
-		static int cycles, time_steps, out_time_steps;
+		static int cycles, time_steps, out_time_steps, err_time_steps;
 		static double frame_time;
+		static double cfl, cfl_dt_min, cfl_dt_max;		// target Courant number (0 keeps dt fixed), dt bounds in nominal steps
+		static int grid_time_steps;		// rebuild the moving geometry every that many steps, 0 keeps the first grid
+		static int frame_cache;			// rebuilt subframes kept for the next cycles, 0 disables
 
 		// output grid
 		static outFormat out_fmt;
 		static int outdimx, outdimy, outdimz;
 		static vector<string> out_vars;
+		static int out_deflate;			// deflate level of the NetCDF output variables, 0 stores them uncompressed
 
 		// solver params
 		static solver solverID;		
 		static int num_global, num_local;
+		static double residual_tol;		// stop the non-linear iterations once they change the fields by less, 0 disables
 
 		Config()
 		{
@@ -95,11 +100,19 @@ namespace Common
 			cycles = 1;
 			time_steps = 50;
 			out_time_steps = 10;
+			err_time_steps = 10;
+			cfl = 0.0;
+			cfl_dt_min = 0.25;
+			cfl_dt_max = 4.0;
+			grid_time_steps = 0;
+			frame_cache = 0;
 			outdimx = outdimy = outdimz = 50;
 			out_vars.clear();
+			out_deflate = 0;
 
 			num_global = 2;
 			num_local = 1;
+			residual_tol = 0.0;
 
 			// must specify 
 			problem_dim = _unknownDim;
@@ -228,13 +241,20 @@ namespace Common
 				if (!strcmp(str, "cycles")) ReadInt(file, cycles);
 				if (!strcmp(str, "frame_time")) ReadDouble(file, frame_time);
 				if (!strcmp(str, "time_steps")) ReadInt(file, time_steps);
+				if (!strcmp(str, "cfl")) ReadDouble(file, cfl);
+				if (!strcmp(str, "cfl_dt_min")) ReadDouble(file, cfl_dt_min);
+				if (!strcmp(str, "cfl_dt_max")) ReadDouble(file, cfl_dt_max);
+				if (!strcmp(str, "grid_time_steps")) ReadInt(file, grid_time_steps);
+				if (!strcmp(str, "frame_cache")) ReadInt(file, frame_cache);
 
 				if (!strcmp(str, "out_vars")) ReadVars(file);
 				if (!strcmp(str, "out_time_steps")) ReadInt(file, out_time_steps);
+				if (!strcmp(str, "err_time_steps")) ReadInt(file, err_time_steps);
 				if (!strcmp(str, "out_gridx")) ReadInt(file, outdimx);
 				if (!strcmp(str, "out_gridy")) ReadInt(file, outdimy);
 				if (!strcmp(str, "out_gridz")) ReadInt(file, outdimz);
 				if (!strcmp(str, "out_fmt")) ReadOutFormat(file);
+				if (!strcmp(str, "out_deflate")) ReadInt(file, out_deflate);
 				
 				if (!strcmp(str, "depth")) ReadDouble(file, depth);		
 				if (!strcmp(str, "depth_var")) ReadDouble(file, depth_var);		
@@ -242,6 +262,7 @@ namespace Common
 				if (!strcmp(str, "solver")) ReadSolver(file);
 				if (!strcmp(str, "num_global")) ReadInt(file, num_global);
 				if (!strcmp(str, "num_local")) ReadInt(file, num_local);
+				if (!strcmp(str, "residual_tol")) ReadDouble(file, residual_tol);
 			}	
 
 			fclose(file);
@@ -291,12 +312,16 @@ namespace Common
 
 	double Config::R_specific, Config::k, Config::cv, Config::baseT;		 
 
-	int Config::cycles, Config::time_steps, Config::out_time_steps;
+	int Config::cycles, Config::time_steps, Config::out_time_steps, Config::err_time_steps;
 	double Config::frame_time;
+	double Config::cfl, Config::cfl_dt_min, Config::cfl_dt_max;
+	int Config::grid_time_steps, Config::frame_cache;
 
 	int Config::outdimx, Config::outdimy, Config::outdimz;
 	vector<string> Config::out_vars;
+	int Config::out_deflate;
 
 	solver Config::solverID;		
 	int Config::num_global, Config::num_local;
+	double Config::residual_tol;
 }
@@ -133,147 +133,205 @@ namespace Common
 		fclose(file);
 	}
 
-	static void OutputNetCDF3D_header(const char *outputPath, BBox3D *bbox, DepthInfo3D *depths, double timestep, double time, int outdimx, int outdimy, int outdimz, const vector<string>& vars, bool xy_degree_units)
+	// 3D results in NetCDF: the file stays open for the whole run, the layers are stored as FTYPE
+	// with one chunk of (1, outdimx, outdimy, outdimz) per layer and variable, optionally deflated
+	class NetCDFWriter3D
 	{
-		const int num_vars = 5;
-		const char* var_short[num_vars] = { "u", "v", "w", "T", "d" };
-		const char* var_long[num_vars] = { "x-velocity", "y-velocity", "z-velocity", "temperature", "depth" };
+	public:
+		NetCDFWriter3D() : ncid(-1), use_var( num_vars, false ), var_id( num_vars ), buf(NULL) { }
+		~NetCDFWriter3D() { Close(); }
+
+		void Create(const char *outputPath, BBox3D *bbox, DepthInfo3D *depths, double timestep, double time, int outdimx, int outdimy, int outdimz, const vector<string>& vars, bool xy_degree_units, int deflate = 0)
+		{
+			for( int i = 0; i < num_vars; i++ ) {
+				vector<string>::const_iterator pos = find( vars.begin(), vars.end(), VarShort(i) );
+				use_var[i] = ( pos != vars.end() );
+			}
 		
-		vector<bool> use_var( num_vars, false );
-		for( int i = 0; i < num_vars; i++ ) {
-			vector<string>::const_iterator pos = find( vars.begin(), vars.end(), var_short[i] );
-			use_var[i] = ( pos != vars.end() );
-		}
+			// create netcdf
+			nc_create( outputPath, NC_NETCDF4, &ncid );
+			// enter define mode
 		
-		// create netcdf
-		int ncid;
-		nc_create( outputPath, NC_NETCDF4, &ncid );
-		// enter define mode
+			// write dimensions
+			int dimx_id, dimy_id, dimz_id, dimt_id;
+			nc_def_dim( ncid, "x", outdimx, &dimx_id );
+			nc_def_dim( ncid, "y", outdimy, &dimy_id );
+			nc_def_dim( ncid, "z", outdimz, &dimz_id );
+			nc_def_dim( ncid, "t", NC_UNLIMITED, &dimt_id );
+
+			// write variables
+			int varx_id, vary_id, varz_id, vart_id;
+			nc_def_var( ncid, "x", NC_FLOAT, 1, &dimx_id, &varx_id ); 
+			nc_def_var( ncid, "y", NC_FLOAT, 1, &dimy_id, &vary_id ); 
+			nc_def_var( ncid, "z", NC_FLOAT, 1, &dimz_id, &varz_id ); 
+			nc_def_var( ncid, "time", NC_DOUBLE, 1, &dimt_id, &vart_id ); 
+			const int dim_ids[] = { dimt_id, dimx_id, dimy_id, dimz_id };
+			size_t chunks[] = { 1, (size_t)outdimx, (size_t)outdimy, (size_t)outdimz };
+			for( int i = 0; i < num_vars; i++ ) 
+				if( use_var[i] ) {
+					if( i == num_vars-1 ) nc_def_var( ncid, VarShort(i), NC_FLOAT, 2, &dim_ids[1], &var_id[i] ); 
+					else {
+						// one chunk per output layer, so a layer goes out in a single write
+						nc_def_var( ncid, VarShort(i), (sizeof(FTYPE) == sizeof(float)) ? NC_FLOAT : NC_DOUBLE, 4, dim_ids, &var_id[i] ); 
+						nc_def_var_chunking( ncid, var_id[i], NC_CHUNKED, chunks );
+						if( deflate > 0 ) nc_def_var_deflate( ncid, var_id[i], 1, 1, deflate );
+					}
+				}
+
+			// write attributes
+			float bb[2];
+			bb[0] = bbox->pMin.x;
+			bb[1] = bbox->pMax.x;
 		
-		// write dimensions
-		int dimx_id, dimy_id, dimz_id, dimt_id;
-		nc_def_dim( ncid, "x", outdimx, &dimx_id );
-		nc_def_dim( ncid, "y", outdimy, &dimy_id );
-		nc_def_dim( ncid, "z", outdimz, &dimz_id );
-		nc_def_dim( ncid, "t", NC_UNLIMITED, &dimt_id );
-
-		// write variables
-		int varx_id, vary_id, varz_id, vart_id;
-		nc_def_var( ncid, "x", NC_FLOAT, 1, &dimx_id, &varx_id ); 
-		nc_def_var( ncid, "y", NC_FLOAT, 1, &dimy_id, &vary_id ); 
-		nc_def_var( ncid, "z", NC_FLOAT, 1, &dimz_id, &varz_id ); 
-		nc_def_var( ncid, "time", NC_DOUBLE, 1, &dimt_id, &vart_id ); 
-		const int dim_ids[] = { dimt_id, dimx_id, dimy_id, dimz_id };
-		vector<int> var_id( num_vars );
-		for( int i = 0; i < num_vars; i++ ) 
-			if( use_var[i] ) {
-				if( i == num_vars-1 ) nc_def_var( ncid, var_short[i], NC_FLOAT, 2, &dim_ids[1], &var_id[i] ); 
-					else nc_def_var( ncid, var_short[i], NC_DOUBLE, 4, dim_ids, &var_id[i] ); 
-			}
+			nc_put_att_float( ncid, varx_id, "actual_range", NC_FLOAT, 2, bb );
+			nc_put_att_text( ncid, varx_id, "long_name", 7, "x coord" );
 
-		// write attributes
-		float bb[2];
-		bb[0] = bbox->pMin.x;
-		bb[1] = bbox->pMax.x;
+			bb[0] = bbox->pMin.y;
+			bb[1] = bbox->pMax.y;
 		
-		nc_put_att_float( ncid, varx_id, "actual_range", NC_FLOAT, 2, bb );
-		nc_put_att_text( ncid, varx_id, "long_name", 7, "x coord" );
+			nc_put_att_float( ncid, vary_id, "actual_range", NC_FLOAT, 2, bb );
+			nc_put_att_text( ncid, vary_id, "long_name", 7, "y coord" );
+
+			if( xy_degree_units ) {
+				nc_put_att_text( ncid, varx_id, "units", 12, "degree_north" );
+				nc_put_att_text( ncid, vary_id, "units", 11, "degree_east" );
+			}
+			else {
+				nc_put_att_text( ncid, varx_id, "units", 6, "metres" );
+				nc_put_att_text( ncid, vary_id, "units", 6, "metres" );
+			}
+
+			bb[0] = bbox->pMin.z;
+			bb[1] = bbox->pMax.z;
+			nc_put_att_text( ncid, varz_id, "units", 6, "metres" );
+			nc_put_att_float( ncid, varz_id, "actual_range", NC_FLOAT, 2, bb );
+			nc_put_att_text( ncid, varz_id, "long_name", 7, "z coord" );
+
+			double tt[2];
+			tt[0] = 0.0;
+			tt[1] = time;
+			nc_put_att_text( ncid, vart_id, "units", 1, "s" );
+			nc_put_att_double( ncid, vart_id, "actual_range", NC_DOUBLE, 2, tt );
+			nc_put_att_text( ncid, vart_id, "long_name", 4, "time" );
+
+			tt[0] = -1.0;
+			tt[1] = 1.0;
+			bb[0] = MISSING_VALUE;
+			for( int i = 0; i < num_vars; i++ ) 
+				if( use_var[i] ) {
+					switch( VarShort(i)[0] ) {
+						case 'T': nc_put_att_text( ncid, var_id[i], "units", 3, "tmp" ); break;
+						case 'd': nc_put_att_text( ncid, var_id[i], "units", 1, "m" ); break;
+						default: nc_put_att_text( ncid, var_id[i], "units", 3, "m/s" ); break;
+					}
+					nc_put_att_double( ncid, var_id[i], "actual_range", NC_DOUBLE, 2, tt );
+					nc_put_att_double( ncid, var_id[i], "valid_range", NC_DOUBLE, 2, tt );
+					nc_put_att_float( ncid, var_id[i], "missing_value", NC_FLOAT, 1, bb );
+					nc_put_att_text( ncid, var_id[i], "long_name", strlen( VarLong(i) ), VarLong(i) );
+					nc_put_att_text( ncid, var_id[i], "var_desc", strlen( VarShort(i) ), VarShort(i) );
+				}
 
-		bb[0] = bbox->pMin.y;
-		bb[1] = bbox->pMax.y;
+			// global attributes
+			// TODO : add grid desc, more info to output desc
+			nc_put_att_text( ncid, NC_GLOBAL, "Conventions", 6, "COARDS" );
+			nc_put_att_text( ncid, NC_GLOBAL, "title", 24, "cmc-fluid-solver results" );
+			nc_put_att_text( ncid, NC_GLOBAL, "history", 33, "created by using cmc-fluid-solver" );
+			nc_put_att_text( ncid, NC_GLOBAL, "description", 9, "Test data" );
+			nc_put_att_text( ncid, NC_GLOBAL, "platform", 5, "Model" );
+
+			nc_enddef( ncid );
+			// exit define mode
+
+			// write axis data
+			float ddx = (float)(bbox->pMax.x - bbox->pMin.x) / (outdimx);
+			float ddy = (float)(bbox->pMax.y - bbox->pMin.y) / (outdimy);
+			float ddz = (float)(bbox->pMax.z - bbox->pMin.z) / (outdimz);
 		
-		nc_put_att_float( ncid, vary_id, "actual_range", NC_FLOAT, 2, bb );
-		nc_put_att_text( ncid, vary_id, "long_name", 7, "y coord" );
+			float *fp = new float[outdimx];
+			for( int i = 0; i < outdimx; i++ )
+				fp[i] = bbox->pMin.x + ddx * i;
+			nc_put_var_float( ncid, varx_id, fp );
+			delete [] fp;
+
+			fp = new float[outdimy];
+			for( int i = 0; i < outdimy; i++ )
+				fp[i] = bbox->pMin.y + ddy * i;
+			nc_put_var_float( ncid, vary_id, fp );
+			delete [] fp;
+
+			fp = new float[outdimz];
+			for( int i = 0; i < outdimz; i++ )
+				fp[i] = bbox->pMin.z + ddz * i;
+			nc_put_var_float( ncid, varz_id, fp );
+			delete [] fp;
+
+			const size_t start[1] = { 0 };
+			const size_t count[1] = { (size_t)(time/timestep) };
+			double* dp = new double[count[0]];
+			for( int i = 0; i < (int)count[0]; i++ ) 
+				dp[i] = i * timestep;
+			nc_put_vara_double( ncid, vart_id, start, count, dp );
+			delete [] dp;
+
+			// write depth data
+			if( use_var[num_vars-1] ) {
+				DepthInfo3D out_depths( outdimx, outdimy, depths );
+				nc_put_var_float( ncid, var_id[num_vars-1], out_depths.depth );
+			}
 
-		if( xy_degree_units ) {
-			nc_put_att_text( ncid, varx_id, "units", 12, "degree_north" );
-			nc_put_att_text( ncid, vary_id, "units", 11, "degree_east" );
-		}
-		else {
-			nc_put_att_text( ncid, varx_id, "units", 6, "metres" );
-			nc_put_att_text( ncid, vary_id, "units", 6, "metres" );
+			dimx = outdimx;
+			dimy = outdimy;
+			dimz = outdimz;
+			buf = new FTYPE[dimx * dimy * dimz];
 		}
 
-		bb[0] = bbox->pMin.z;
-		bb[1] = bbox->pMax.z;
-		nc_put_att_text( ncid, varz_id, "units", 6, "metres" );
-		nc_put_att_float( ncid, varz_id, "actual_range", NC_FLOAT, 2, bb );
-		nc_put_att_text( ncid, varz_id, "long_name", 7, "z coord" );
-
-		double tt[2];
-		tt[0] = 0.0;
-		tt[1] = time;
-		nc_put_att_text( ncid, vart_id, "units", 1, "s" );
-		nc_put_att_double( ncid, vart_id, "actual_range", NC_DOUBLE, 2, tt );
-		nc_put_att_text( ncid, vart_id, "long_name", 4, "time" );
-
-		tt[0] = -1.0;
-		tt[1] = 1.0;
-		bb[0] = MISSING_VALUE;
-		for( int i = 0; i < num_vars; i++ ) 
-			if( use_var[i] ) {
-				switch( var_short[i][0] ) {
-					case 'T': nc_put_att_text( ncid, var_id[i], "units", 3, "tmp" ); break;
-					case 'd': nc_put_att_text( ncid, var_id[i], "units", 1, "m" ); break;
-					default: nc_put_att_text( ncid, var_id[i], "units", 3, "m/s" ); break;
+		void WriteLayer(Vec3D *vel, double *T, int time)
+		{
+			const size_t start[] = { (size_t)time, 0, 0, 0 };
+			const size_t count[] = { 1, (size_t)dimx, (size_t)dimy, (size_t)dimz };
+			int size = dimx * dimy * dimz;
+
+			// depths were added in header
+			for( int i = 0; i < num_vars-1; i++ ) {
+				if( !use_var[i] ) continue;
+
+				// collect output values
+				switch( VarShort(i)[0] ) {
+					case 'u': for( int idx = 0; idx < size; idx++ ) buf[idx] = (FTYPE)vel[idx].x; break;
+					case 'v': for( int idx = 0; idx < size; idx++ ) buf[idx] = (FTYPE)vel[idx].y; break;
+					case 'w': for( int idx = 0; idx < size; idx++ ) buf[idx] = (FTYPE)vel[idx].z; break;
+					case 'T': for( int idx = 0; idx < size; idx++ ) buf[idx] = (FTYPE)T[idx]; break;
 				}
-				nc_put_att_double( ncid, var_id[i], "actual_range", NC_DOUBLE, 2, tt );
-				nc_put_att_double( ncid, var_id[i], "valid_range", NC_DOUBLE, 2, tt );
-				nc_put_att_float( ncid, var_id[i], "missing_value", NC_FLOAT, 1, bb );
-				nc_put_att_text( ncid, var_id[i], "long_name", strlen( var_long[i] ), var_long[i] );
-				nc_put_att_text( ncid, var_id[i], "var_desc", strlen( var_short[i] ), var_short[i] );
+
+				// add new data
+				PutLayer( var_id[i], start, count, buf );
 			}
+		}
 
-		// global attributes
-		// TODO : add grid desc, more info to output desc
-		nc_put_att_text( ncid, NC_GLOBAL, "Conventions", 6, "COARDS" );
-		nc_put_att_text( ncid, NC_GLOBAL, "title", 24, "cmc-fluid-solver results" );
-		nc_put_att_text( ncid, NC_GLOBAL, "history", 33, "created by using cmc-fluid-solver" );
-		nc_put_att_text( ncid, NC_GLOBAL, "description", 9, "Test data" );
-		nc_put_att_text( ncid, NC_GLOBAL, "platform", 5, "Model" );
-
-		nc_enddef( ncid );
-		// exit define mode
-
-		// write axis data
-		float ddx = (float)(bbox->pMax.x - bbox->pMin.x) / (outdimx);
-		float ddy = (float)(bbox->pMax.y - bbox->pMin.y) / (outdimy);
-		float ddz = (float)(bbox->pMax.z - bbox->pMin.z) / (outdimz);
-		
-		float *fp = new float[outdimx];
-		for( int i = 0; i < outdimx; i++ )
-			fp[i] = bbox->pMin.x + ddx * i;
-		nc_put_var_float( ncid, varx_id, fp );
-		delete [] fp;
-
-		fp = new float[outdimy];
-		for( int i = 0; i < outdimy; i++ )
-			fp[i] = bbox->pMin.y + ddy * i;
-		nc_put_var_float( ncid, vary_id, fp );
-		delete [] fp;
-
-		fp = new float[outdimz];
-		for( int i = 0; i < outdimz; i++ )
-			fp[i] = bbox->pMin.z + ddz * i;
-		nc_put_var_float( ncid, varz_id, fp );
-		delete [] fp;
-
-		const size_t start[1] = { 0 };
-		const size_t count[1] = { (int)(time/timestep) };
-		double* dp = new double[count[0]];
-		for( int i = 0; i < (int)count[0]; i++ ) 
-			dp[i] = i * timestep;
-		nc_put_vara_double( ncid, vart_id, start, count, dp );
-		delete [] dp;
-
-		// write depth data
-		if( use_var[num_vars-1] ) {
-			DepthInfo3D out_depths( outdimx, outdimy, depths );
-			nc_put_var_float( ncid, var_id[num_vars-1], out_depths.depth );
+		void Close()
+		{
+			if( ncid >= 0 ) nc_close( ncid );
+			ncid = -1;
+			if( buf != NULL ) delete [] buf;
+			buf = NULL;
 		}
-		
-		nc_close( ncid );
-	}
+
+	private:
+		static const int num_vars = 5;
+
+		// names are kept in functions, the header is included by several translation units
+		static const char *VarShort(int i) { static const char* names[num_vars] = { "u", "v", "w", "T", "d" }; return names[i]; }
+		static const char *VarLong(int i) { static const char* names[num_vars] = { "x-velocity", "y-velocity", "z-velocity", "temperature", "depth" }; return names[i]; }
+
+		int ncid;
+		vector<bool> use_var;
+		vector<int> var_id;
+		int dimx, dimy, dimz;
+		FTYPE *buf;		// one layer of a variable
+
+		void PutLayer(int varid, const size_t *start, const size_t *count, const float *data) { nc_put_vara_float( ncid, varid, start, count, data ); }
+		void PutLayer(int varid, const size_t *start, const size_t *count, const double *data) { nc_put_vara_double( ncid, varid, start, count, data ); }
+	};
 
 	static void OutputNetCDFHeader2D(const char *outputPath, BBox2D *bbox, double timestep, double time, int outdimx, int outdimy)
 	{
@@ -347,46 +405,6 @@ namespace Common
 		fclose(file);
 	}
 
-	static void OutputNetCDF3D_layer(const char *outputPath, Vec3D *vel, double *T, int time, int dimx, int dimy, int dimz, const vector<string>& vars)
-	{
-		// open netcdf
-		int ncid;
-		nc_open( outputPath, NC_WRITE, &ncid );
-
-		const size_t start[] = { time, 0, 0, 0 };
-		const size_t count[] = { 1, dimx, dimy, dimz };
-		double* dp = new double[dimx * dimy * dimz];
-			
-		for( int v = 0; v < (int)vars.size(); v++ ) {
-			
-			// depths were added in header
-			if( vars[v] == (string)"d" ) continue;
-
-			// get var id
-			int varid;
-			nc_inq_varid( ncid, vars[v].c_str(), &varid );
-
-			// collect output values
-			for( int i = 0; i < dimx; i++ ) 
-				for( int j = 0; j < dimy; j++ ) 
-					for( int k = 0; k < dimz; k++ ) {
-						int idx = i * dimy * dimz + j * dimz + k;
-						switch( vars[v][0] ) {
-							case 'u': dp[idx] = vel[idx].x; break;
-							case 'v': dp[idx] = vel[idx].y; break;
-							case 'w': dp[idx] = vel[idx].z; break;
-							case 'T': dp[idx] = T[idx]; break;
-						}
-					}
-
-			// add new data
-			nc_put_vara_double( ncid, varid, start, count, dp );
-		}
-
-		delete [] dp;
-		nc_close( ncid );	
-	}
-
 	static void OutputNetCDF2D_U(const char *outputPath, Vec2D *v, double *T, int dimx, int dimy, bool finish)
 	{
 		FILE *file = NULL;
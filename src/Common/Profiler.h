@@ -46,10 +46,19 @@ namespace Common
 	private:
 		cpu_timer timer;
 		map<string, EventInfo> events;
+		map<string, double> counters;
 
 	public:
-		Profiler() { events.clear(); }
-		~Profiler() { events.clear(); }
+		Profiler() { events.clear(); counters.clear(); }
+		~Profiler() { events.clear(); counters.clear(); }
+
+		// accumulates a non-timing quantity (work units, iterations) reported after the timings
+		void AddCounter(const char *name, double value)
+		{
+#if PROFILE_ENABLE
+			counters[name] += value;
+#endif
+		}
 
 		void StartEvent()
 		{
@@ -108,6 +117,13 @@ namespace Common
 					total_time += e.total_ms;
 				}
 				printf("%s,%.2f,sec\n", "Overall", total_time / 1000);
+
+				if( !counters.empty() )
+				{
+					printf("%s,%s,\n", "Counter Name", "Total");
+					for( map<string, double>::iterator it = counters.begin(); it != counters.end(); it++ )
+						printf("%s,%.0f,\n", it->first.c_str(), it->second);
+				}
 			}
 			else
 			{
@@ -127,6 +143,13 @@ namespace Common
 					total_time += e.total_ms;
 				}
 				printf("%16s%16.2f sec\n", "Overall", total_time / 1000);
+
+				if( !counters.empty() )
+				{
+					printf("%16s%16s\n", "Counter Name", "Total");
+					for( map<string, double>::iterator it = counters.begin(); it != counters.end(); it++ )
+						printf("%16s%16.0f\n", it->first.c_str(), it->second);
+				}
 			}
 			fflush(stdout);
 #endif
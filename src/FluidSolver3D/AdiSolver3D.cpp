@@ -22,10 +22,42 @@
 #include "../Common/Algorithms.h"
 #endif
 
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 //#include "../Common/test_util.h"
 
 namespace FluidSolver3D
 {
+	static inline int GetThreadNum()
+	{
+#ifdef _OPENMP
+		return omp_get_thread_num();
+#else
+		return 0;
+#endif
+	}
+
+	static inline int GetNumThreads()
+	{
+#ifdef _OPENMP
+		return omp_get_num_threads();
+#else
+		return 1;
+#endif
+	}
+
+	static inline int GetMaxThreads()
+	{
+#ifdef _OPENMP
+		return omp_get_max_threads();
+#else
+		return 1;
+#endif
+	}
 
 	double  AdiSolver3D::sum_layer(char ch)
 	{
@@ -66,11 +98,13 @@ namespace FluidSolver3D
 	AdiSolver3D::AdiSolver3D()
 	{
 		grid = NULL;
+		backend = CPU;
 
 		ifdebug = false;
 
 		cur = NULL;
 		temp = NULL;
+		tempNext = NULL;
 		half = NULL;
 		next = NULL;
 
@@ -83,6 +117,18 @@ namespace FluidSolver3D
 		c = NULL;
 		d = NULL;
 		x = NULL;
+		a_batch = b_batch = c_batch = d_batch = x_batch = NULL;
+		c_work = d_work = NULL;
+		spike = spikeReduced = NULL;
+		mixedPrecision = false;
+		tolerance = 0;
+		h_residual = NULL;
+		h_maxVel = NULL;
+		h_divIndex = NULL;
+		numDivIndex = 0;
+		sweepResidual = iterResidual = 0;
+		numThreads = 1;
+		scratchStride = 0;
 
 		d_c = d_cY = NULL;
 		d_x = d_xY = NULL;
@@ -91,6 +137,25 @@ namespace FluidSolver3D
 		h_listY = NULL;
 		h_listZ = NULL;
 
+		h_node_listX = NULL;
+		h_node_listY = NULL;
+		h_node_listZ = NULL;
+		h_order[X] = h_order[Y] = h_order[Z] = NULL;
+		h_batches[X] = h_batches[Y] = h_batches[Z] = NULL;
+		h_schedule[X] = h_schedule[Y] = h_schedule[Z] = NULL;
+		h_threadFirst[X] = h_threadFirst[Y] = h_threadFirst[Z] = NULL;
+		h_threadWork[X] = h_threadWork[Y] = h_threadWork[Z] = NULL;
+		numSweeps[X] = numSweeps[Y] = numSweeps[Z] = 0;
+		numBatches[X] = numBatches[Y] = numBatches[Z] = 0;
+		numSpike[X] = numSpike[Y] = numSpike[Z] = 0;
+		h_mergeIndex[X] = h_mergeIndex[Y] = h_mergeIndex[Z] = NULL;
+		numMergeIndex[X] = numMergeIndex[Y] = numMergeIndex[Z] = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			comuNumSegsBlZ[i] = NULL;
+			batchesBlZ[i] = NULL;
+		}
+
 		d_listX = NULL;
 		d_listY = NULL;
 		d_listZ = NULL;
@@ -104,6 +169,7 @@ namespace FluidSolver3D
 	{	
 		if (cur != NULL) delete cur;
 		if (temp != NULL) delete temp;
+		if (tempNext != NULL) delete tempNext;
 		if (half != NULL) delete half;
 		if (next != NULL) delete next;
 		
@@ -117,10 +183,38 @@ namespace FluidSolver3D
 		if (d != NULL) delete [] d;
 		if (x != NULL) delete [] x;
 
+		if (a_batch != NULL) delete [] a_batch;
+		if (c_work != NULL) delete [] c_work;
+		if (d_work != NULL) delete [] d_work;
+		if (spike != NULL) delete [] spike;
+		if (spikeReduced != NULL) delete [] spikeReduced;
+		if (h_residual != NULL) delete [] h_residual;
+		if (h_maxVel != NULL) delete [] h_maxVel;
+		if (h_divIndex != NULL) delete [] h_divIndex;
+		if (b_batch != NULL) delete [] b_batch;
+		if (c_batch != NULL) delete [] c_batch;
+		if (d_batch != NULL) delete [] d_batch;
+		if (x_batch != NULL) delete [] x_batch;
+
 		if (h_listX != NULL) delete [] h_listX;
 		if (h_listY != NULL) delete [] h_listY;
 		if (h_listZ != NULL) delete [] h_listZ;
 
+		if (h_node_listX != NULL) delete [] h_node_listX;
+		if (h_node_listY != NULL) delete [] h_node_listY;
+		if (h_node_listZ != NULL) delete [] h_node_listZ;
+		for (int i = 0; i < 3; i++)
+		{
+			if (h_order[i] != NULL) delete [] h_order[i];
+			if (h_batches[i] != NULL) delete [] h_batches[i];
+			if (h_schedule[i] != NULL) delete [] h_schedule[i];
+			if (h_threadFirst[i] != NULL) delete [] h_threadFirst[i];
+			if (h_threadWork[i] != NULL) delete [] h_threadWork[i];
+			if (h_mergeIndex[i] != NULL) delete [] h_mergeIndex[i];
+			if (comuNumSegsBlZ[i] != NULL) delete [] comuNumSegsBlZ[i];
+			if (batchesBlZ[i] != NULL) delete [] batchesBlZ[i];
+		}
+
 		if (d_cY != NULL && d_cY != d_c) multiDevFree<FTYPE>(d_cY);
 		if (d_c != NULL) multiDevFree<FTYPE>(d_c);
 		if (d_xY != NULL && d_xY != d_x) multiDevFree<FTYPE>(d_xY);
@@ -136,22 +230,27 @@ namespace FluidSolver3D
 
 		if (mpi_buf != NULL) gpuSafeCall( cudaFreeHost(mpi_buf), "cudaFreeHost");
 
-		GPUplan* pGPUplan = GPUplan::Instance();
-		for (int i = 0; i < 3; i++ )
+		if (backend == GPU)
 		{
-			delete [] numSegsGPU[i];
-			for (int iDev = 0; iDev < pGPUplan->size(); iDev++)
-				{
-					delete [] numSegsBlZGPU[i][iDev];
-					delete [] comuNumSegsBlZGPU[i][iDev];
-				}
-				delete [] numSegsBlZGPU[i];
-				delete [] comuNumSegsBlZGPU[i];
+			GPUplan* pGPUplan = GPUplan::Instance();
+			for (int i = 0; i < 3; i++ )
+			{
+				delete [] numSegsGPU[i];
+				for (int iDev = 0; iDev < pGPUplan->size(); iDev++)
+					{
+						delete [] numSegsBlZGPU[i][iDev];
+						delete [] comuNumSegsBlZGPU[i][iDev];
+					}
+					delete [] numSegsBlZGPU[i];
+					delete [] comuNumSegsBlZGPU[i];
+			}
 		}
 	}
 
 	AdiSolver3D::~AdiSolver3D()
 	{
+		for (int i = X; i <= Z; i++)
+			FlushWorkCounters((DirType)i);
 		prof.PrintTimings(csvFormat);
 
 		FreeMemory();
@@ -163,6 +262,16 @@ namespace FluidSolver3D
 		decomposeOpt = _decomposeOpt;
 	}
 
+	void AdiSolver3D::SetOptionsCPU(bool _mixedPrecision)
+	{
+		mixedPrecision = _mixedPrecision;
+	}
+
+	void AdiSolver3D::SetTolerance(FTYPE _tolerance)
+	{
+		tolerance = _tolerance;
+	}
+
 	void AdiSolver3D::Init(BackendType _backend, bool _csv, Grid3D* _grid, FluidParams &_params, bool _useBlocking = false, int _nblockZ = 1)// pack launching parameters into a structure!!!
 	{
 		grid = _grid;
@@ -190,6 +299,10 @@ namespace FluidSolver3D
 		h_listY = new Segment3D[grid->dimx * grid->dimz * MAX_SEGS_PER_ROW];
 		h_listZ = new Segment3D[grid->dimx * grid->dimy * MAX_SEGS_PER_ROW];
 
+		h_node_listX = new NodesBoundary3D[grid->dimy * grid->dimz * MAX_SEGS_PER_ROW];
+		h_node_listY = new NodesBoundary3D[grid->dimx * grid->dimz * MAX_SEGS_PER_ROW];
+		h_node_listZ = new NodesBoundary3D[grid->dimx * grid->dimy * MAX_SEGS_PER_ROW];
+
 		if( backend == GPU )
 		{
 			GPUplan *pGPUplan = GPUplan::Instance();
@@ -239,11 +352,94 @@ namespace FluidSolver3D
 		}
 		else
 		{
-			a = new FTYPE[n * n * n * MAX_SEGS_PER_ROW];
-			b = new FTYPE[n * n * n * MAX_SEGS_PER_ROW];
-			c = new FTYPE[n * n * n * MAX_SEGS_PER_ROW];
-			d = new FTYPE[n * n * n * MAX_SEGS_PER_ROW];
-			x = new FTYPE[n * n * n * MAX_SEGS_PER_ROW];
+			// per-thread scratch arenas: each thread solves one segment at a time, 
+			// so it needs room for the longest possible segment only
+			numThreads = GetMaxThreads();
+			scratchStride = (n + 15) & ~15;		// pad to 64 bytes to avoid false sharing
+			a = new FTYPE[numThreads * scratchStride];
+			b = new FTYPE[numThreads * scratchStride];
+			c = new FTYPE[numThreads * scratchStride];
+			d = new FTYPE[numThreads * scratchStride * SOLVER_VAR_NUM];		// room for several right-hand sides
+			x = new FTYPE[numThreads * scratchStride * SOLVER_VAR_NUM];
+
+			// one cache line per thread
+			h_residual = new FTYPE[numThreads * 16];
+			h_maxVel = new FTYPE[numThreads * 16];
+			for (int i = 0; i < numThreads * 16; i++)
+				h_residual[i] = h_maxVel[i] = 0;
+
+#if SPIKE_SOLVER_ENABLE
+			// arenas of the segment shared by the team: a, b, c, v, w and three right-hand sides for each of
+			// the two matrices (U, V, W and T), the interface system has two unknowns per pair of parts;
+			// the SPIKE factorization runs in FTYPE only, so with mixed precision long segments stay serial
+			if (!mixedPrecision)
+			{
+				spike = new FTYPE[2 * (5 + SOLVER_VAR_NUM - 1) * scratchStride];
+				spikeReduced = new FTYPE[2 * (5 + SOLVER_VAR_NUM - 1) * 2 * numThreads];
+			}
+#endif
+
+			// double recurrence arenas, sized for a full batch
+			if (mixedPrecision)
+			{
+				c_work = new double[numThreads * scratchStride * SOLVER_BATCH_SIZE];
+				d_work = new double[numThreads * scratchStride * SOLVER_BATCH_SIZE * SOLVER_VAR_NUM];
+			}
+
+#if BATCHED_SOLVER_ENABLE
+			a_batch = new FTYPE[numThreads * scratchStride * SOLVER_BATCH_SIZE];
+			b_batch = new FTYPE[numThreads * scratchStride * SOLVER_BATCH_SIZE];
+			c_batch = new FTYPE[numThreads * scratchStride * SOLVER_BATCH_SIZE];
+			d_batch = new FTYPE[numThreads * scratchStride * SOLVER_BATCH_SIZE * SOLVER_VAR_NUM];
+			x_batch = new FTYPE[numThreads * scratchStride * SOLVER_BATCH_SIZE * SOLVER_VAR_NUM];
+
+			h_order[X] = new int[grid->dimy * grid->dimz * MAX_SEGS_PER_ROW];
+			h_order[Y] = new int[grid->dimx * grid->dimz * MAX_SEGS_PER_ROW];
+			h_order[Z] = new int[grid->dimx * grid->dimy * MAX_SEGS_PER_ROW];
+			h_batches[X] = new int[grid->dimy * grid->dimz * MAX_SEGS_PER_ROW + 1];
+			h_batches[Y] = new int[grid->dimx * grid->dimz * MAX_SEGS_PER_ROW + 1];
+			h_batches[Z] = new int[grid->dimx * grid->dimy * MAX_SEGS_PER_ROW + 1];
+#endif
+
+			if (useBlocking)
+				for (int i = X; i <= Y; i++)
+				{
+					comuNumSegsBlZ[i] = new int[nblockZ + 1];
+					batchesBlZ[i] = new int[nblockZ + 1];
+				}
+
+			h_schedule[X] = new int[grid->dimy * grid->dimz * MAX_SEGS_PER_ROW];
+			h_schedule[Y] = new int[grid->dimx * grid->dimz * MAX_SEGS_PER_ROW];
+			h_schedule[Z] = new int[grid->dimx * grid->dimy * MAX_SEGS_PER_ROW];
+			for (int i = 0; i < 3; i++)
+			{
+				int nblocks = (comuNumSegsBlZ[i] != NULL) ? nblockZ : 1;
+				h_threadFirst[i] = new int[nblocks * (numThreads + 1)];
+				h_threadWork[i] = new double[nblocks * numThreads];
+			}
+
+			if (pplan->rank() == 0)
+			{
+				// the sizes of the buffers allocated above: a, b, c, d and x arenas, their batched copies,
+				// the SPIKE arenas, the double recurrences and the extra layer of the fused merge below
+				double dense_mb = 5.0 * sizeof(FTYPE) * n * n * n * MAX_SEGS_PER_ROW / (1024 * 1024);
+				double arena_bytes = (3.0 + 2 * SOLVER_VAR_NUM) * sizeof(FTYPE) * numThreads * scratchStride;
+#if BATCHED_SOLVER_ENABLE
+				arena_bytes *= 1 + SOLVER_BATCH_SIZE;
+#endif
+				if (spike != NULL)
+					arena_bytes += 2.0 * (5 + SOLVER_VAR_NUM - 1) * sizeof(FTYPE) * (scratchStride + 2 * numThreads);
+				if (mixedPrecision)
+					arena_bytes += (1.0 + SOLVER_VAR_NUM) * sizeof(double) * numThreads * scratchStride * SOLVER_BATCH_SIZE;
+				printf("CPU matrices: %.1f KB in %i thread arenas (per-segment layout would take %.1f MB)\n", arena_bytes / 1024, numThreads, dense_mb);
+#if INTERNAL_MERGE_ENABLE
+				printf("Fused merge: one more time layer of %.1f MB\n", 4.0 * sizeof(FTYPE) * dimxNode * grid->dimy * grid->dimz / (1024 * 1024));
+#endif
+				printf("Field pages: %.1f of %.1f MB per field hold wet bricks (%i bricks of %i^3)\n", grid->GetWetPageBytes(sizeof(FTYPE)) / (1024.0 * 1024),
+					(double)sizeof(FTYPE) * grid->dimx * grid->dimy * grid->dimz / (1024 * 1024), grid->GetNumWetBricks(), BRICK_SIZE);
+				if (mixedPrecision)
+					printf("Mixed precision: fields in %s, tridiagonal recurrences in double\n", (sizeof(FTYPE) == sizeof(float)) ? "float" : "double");
+			}
 
 			transposeOpt = false;
 			decomposeOpt = false;
@@ -256,6 +452,10 @@ namespace FluidSolver3D
 			half = new TimeLayer3D(backend, dimxNode, grid->dimy, grid->dimz, (FTYPE)grid->dx, (FTYPE)grid->dy, (FTYPE)grid->dz, haloSize);
 		next = new TimeLayer3D(backend, dimxNode, grid->dimy, grid->dimz, (FTYPE)grid->dx, (FTYPE)grid->dy, (FTYPE)grid->dz, haloSize);
 		temp = new TimeLayer3D(backend, dimxNode, grid->dimy, grid->dimz, (FTYPE)grid->dx, (FTYPE)grid->dy, (FTYPE)grid->dz, haloSize);
+#if INTERNAL_MERGE_ENABLE
+		if (backend == CPU)
+			tempNext = new TimeLayer3D(backend, dimxNode, grid->dimy, grid->dimz, (FTYPE)grid->dx, (FTYPE)grid->dy, (FTYPE)grid->dz, haloSize);
+#endif
 
 #if (TRANSPOSE_OPT == 1)
 		if (transposeOpt)
@@ -267,6 +467,117 @@ namespace FluidSolver3D
 #endif
 	}
 
+	// from the segment length histogram: if there are fewer segments than SIMD lanes of all threads, the ones long
+	// enough to give every thread SPIKE_MIN_PART rows move to the end of the list and are shared by the team
+	int AdiSolver3D::SelectSpikeSegments(DirType dir, int numSeg, Segment3D *list, NodesBoundary3D *node_list)
+	{
+		int maxSize = max(dimx, max(dimy, dimz));
+		int minSize = 2 * SPIKE_MIN_PART;
+		int *hist = new int[maxSize + 1];
+
+		for (int s = 0; s <= maxSize; s++) hist[s] = 0;
+		for (int s = 0; s < numSeg; s++) hist[list[s].size]++;
+
+		int numLong = 0;
+		for (int s = minSize; s <= maxSize; s++) numLong += hist[s];
+		delete [] hist;
+
+		if (numThreads < 2 || numSeg >= numThreads * SOLVER_BATCH_SIZE || numLong == 0)
+			return 0;
+
+		// stable partition, the short segments keep their order
+		Segment3D *segs = new Segment3D[numSeg];
+		NodesBoundary3D *nodes = new NodesBoundary3D[numSeg];
+		int numShort = 0, numMoved = numSeg - numLong;
+		for (int s = 0; s < numSeg; s++)
+		{
+			int dest = (list[s].size >= minSize) ? numMoved++ : numShort++;
+			segs[dest] = list[s];
+			nodes[dest] = node_list[s];
+		}
+		std::copy(segs, segs + numSeg, list);
+		std::copy(nodes, nodes + numSeg, node_list);
+		delete [] segs;
+		delete [] nodes;
+
+		PARAplan *pplan = PARAplan::Instance();
+		if (pplan->rank() == 0)
+			printf("Direction %c: %i of %i segments are split among threads\n", 'X' + dir, numLong, numSeg);
+		return numLong;
+	}
+
+	void AdiSolver3D::SortSegmentsBySize(int first, int last, Segment3D *list, int *order)
+	{
+		// counting sort of segments [first, last), so that consecutive batches hold segments of (nearly) the same length
+		int maxSize = max(dimx, max(dimy, dimz));
+		int *pos = new int[maxSize + 2];
+
+		for (int s = 0; s <= maxSize + 1; s++) pos[s] = 0;
+		for (int s = first; s < last; s++) pos[list[s].size + 1]++;
+		for (int s = 1; s <= maxSize + 1; s++) pos[s] += pos[s-1];
+		for (int s = first; s < last; s++) order[first + pos[list[s].size]++] = s;
+
+		delete [] pos;
+	}
+
+	// orders X/Y segments so that rows which are neighbours along Z follow each other
+	template<DirType dir>
+	struct TileCmp
+	{
+		Segment3D *list;
+		TileCmp(Segment3D *_list) : list(_list) { }
+
+		bool operator()(int s1, int s2) const
+		{
+			const Segment3D &seg1 = list[s1];
+			const Segment3D &seg2 = list[s2];
+			int row1 = (dir == X) ? seg1.posy : seg1.posx;
+			int row2 = (dir == X) ? seg2.posy : seg2.posx;
+			int start1 = (dir == X) ? seg1.posx : seg1.posy;
+			int start2 = (dir == X) ? seg2.posx : seg2.posy;
+
+			if (row1 != row2) return row1 < row2;
+			if (start1 != start2) return start1 < start2;
+			if (seg1.size != seg2.size) return seg1.size < seg2.size;
+			return seg1.posz < seg2.posz;
+		}
+	};
+
+	// groups segments [first, last) into batches appended after the numBatch existing ones
+	template<DirType dir>
+	int AdiSolver3D::CreateBatches(int first, int last, Segment3D *list, int *order, int *batches, int numBatch)
+	{
+#if BLOCKED_SWEEP_ENABLE
+		if (dir != Z)
+		{
+			// a tile holds segments of the same size starting at (posx, posy, posz + l),
+			// so element p of all its segments is contiguous in memory
+			for (int s = first; s < last; s++) order[s] = s;
+			std::sort(order + first, order + last, TileCmp<dir>(list));
+
+			for (int s = first; s < last; s++)
+			{
+				bool newTile = (s == first) || (s - batches[numBatch-1] == SOLVER_BATCH_SIZE);
+				if (!newTile)
+				{
+					const Segment3D &prev = list[order[s-1]];
+					const Segment3D &seg = list[order[s]];
+					newTile = seg.posx != prev.posx || seg.posy != prev.posy || seg.posz != prev.posz + 1 || seg.size != prev.size;
+				}
+				if (newTile) batches[numBatch++] = s;
+			}
+			batches[numBatch] = last;
+			return numBatch;
+		}
+#endif
+
+		SortSegmentsBySize(first, last, list, order);
+		for (int s = first; s < last; s += SOLVER_BATCH_SIZE)
+			batches[numBatch++] = s;
+		batches[numBatch] = last;
+		return numBatch;
+	}
+
 	void AdiSolver3D::OutputSegmentsInfo(int num, Segment3D *list, char *filename)
 	{
 		PARAplan *pplan = PARAplan::Instance();
@@ -291,6 +602,11 @@ namespace FluidSolver3D
 			//CreateSegments(); //put here for consistency - could be placed just before the solver
 			cur->CopyFromGrid(grid, NODE_BOUND);
 			cur->CopyFromGrid(grid, NODE_VALVE);
+			prof.StartEvent();
+			grid->GenerateGridBoundaries(h_node_listZ, numSegs[Z], h_listZ, false);
+			grid->GenerateGridBoundaries(h_node_listY, numSegs[Y], h_listY, false);
+			grid->GenerateGridBoundaries(h_node_listX, numSegs[X], h_listX, false);
+			prof.StopEvent("UpdateBoundaries");
 			break;
 		case GPU:
 			// CreateSegments(); //required
@@ -307,6 +623,64 @@ namespace FluidSolver3D
 	{	
 		PARAplan *pplan = PARAplan::Instance();
 		//CreateSegments();	
+
+		if (h_maxVel != NULL)
+			for (int i = 0; i < numThreads * 16; i++)
+				h_maxVel[i] = 0;
+
+#if PERSISTENT_TEAM_ENABLE
+		// a single team for all copies, sweeps and merges of the step:
+		// the loops inside share their iterations and meet at barriers instead of forking again
+		if (backend == CPU)
+		{
+			#pragma omp parallel default(none) firstprivate(dt, num_global, num_local)
+			SolveTimeStep(dt, num_global, num_local);
+		}
+		else
+#endif
+			SolveTimeStep(dt, num_global, num_local);
+
+		prof.AddCounter("Iterations_global", numIterGlobal);
+		prof.AddCounter("Iterations_local", numIterLocal);
+		prof.AddCounter("Time_steps", 1);
+
+		// smooth results
+		//temp->Smooth(grid, next, NODE_IN);
+
+		// compute error
+    if (computeError)
+    {
+		  prof.StartEvent();
+	  	diffError = (backend == CPU) ? next->EvalDivError(h_divIndex, numDivIndex) : next->EvalDivError(grid);
+	  	prof.StopEvent("EvalDivError");
+    }
+
+		// check & output error
+		if (diffError > ERR_THRESHOLD) {
+			printf("\nError is too big! %f\n", diffError);
+			throw runtime_error("");
+		}
+		else
+			if (pplan->rank() == 0)
+			{
+				printf("\rerr = %.8f,", diffError);
+				fflush(stdout);
+			}
+
+		// clear cells for dynamic grid update
+		// prof.StartEvent();
+		// ClearOutterCells();
+		// prof.StopEvent("ClearLayer");
+
+		// swap current/next pointers 
+		TimeLayer3D *tmp = next;
+		next = cur;
+		cur = tmp;
+	}
+
+	// everything of the time step up to the error evaluation, on CPU all threads of the team run it
+	void AdiSolver3D::SolveTimeStep(FTYPE dt, int num_global, int num_local)
+	{
 		cur->CopyLayerTo(grid, next, NODE_BOUND);
 		cur->CopyLayerTo(grid, next, NODE_VALVE);
 
@@ -316,9 +690,13 @@ namespace FluidSolver3D
 		//OutputSegmentsInfo(numSegs[Z], h_listZ, "segsZ.txt");
 
 		// setup non-linear layer
-		prof.StartEvent();
-		cur->CopyLayerTo(temp);
-		prof.StopEvent("CopyLayer");
+		TeamStartEvent();
+		cur->CopyLayerTo(grid, temp);
+#if INTERNAL_MERGE_ENABLE
+		if (backend == CPU)
+			cur->CopyLayerTo(grid, tempNext);
+#endif
+		TeamStopEvent("CopyLayer");
 
 		// create transposed cur array if opt is enabled
 		if (transposeOpt)
@@ -331,9 +709,18 @@ namespace FluidSolver3D
 
 		TimeLayer3D *tmpLayer = (transposeOpt)? cur:half;
 
+		// only the fused CPU merge measures the residual, the blocked X/Y sweeps merge separately
+		bool checkGlobal = (tolerance > 0) && (backend == CPU) && !useBlocking && INTERNAL_MERGE_ENABLE;
+
+		#pragma omp master
+		numIterGlobal = numIterLocal = 0;
+
 		// do global iterations		
 		for (int it = 0; it < num_global; it++)
 		{
+			#pragma omp master
+			numIterGlobal++;
+
 			// alternating directions
 			SolveDirection(Z, dt, num_local, h_listZ, d_listZ, d_node_listZ, cur, temp, next);
 			if (useBlocking)
@@ -350,72 +737,82 @@ namespace FluidSolver3D
 #if !INTERNAL_MERGE_ENABLE
 			case GPU:
 #endif
-				prof.StartEvent();
+				TeamStartEvent();
 				next->MergeLayerTo(grid, temp, NODE_IN);
-				prof.StopEvent("MergeLayer");
+				TeamStopEvent("MergeLayer");
 				break;
 			}
+
+			// every sweep of this iteration has barely moved the non-linear layer: the step has converged;
+			// iterResidual was last written before the barrier ending the merge, so all threads agree
+			if (checkGlobal && iterResidual < tolerance)
+				break;
 		}
-		// smooth results
-		//temp->Smooth(grid, next, NODE_IN);
+	}
 
-		// compute error
-    if (computeError)
-    {
-		  prof.StartEvent();
-	  	diffError = next->EvalDivError(grid);
-	  	prof.StopEvent("EvalDivError");
-    }
+	// Courant number of the last time step run with dt, from the velocities of its X sweeps;
+	// only the CPU sweeps track them, -1 if unknown
+	double AdiSolver3D::EvalCFL(FTYPE dt)
+	{
+		if (h_maxVel == NULL)
+			return -1;
 
-		// check & output error
-		if (diffError > ERR_THRESHOLD) {
-			printf("\nError is too big! %f\n", diffError);
-			throw runtime_error("");
+		FTYPE vmax[3] = { 0, 0, 0 };
+		for (int t = 0; t < numThreads; t++)
+			for (int v = 0; v < 3; v++)
+				vmax[v] = max(vmax[v], h_maxVel[t * 16 + v]);
+
+		return dt * (vmax[0] / grid->dx + vmax[1] / grid->dy + vmax[2] / grid->dz);
+	}
+
+	// folds the per-thread maxima of the sweep just finished, called by a single thread of the team
+	void AdiSolver3D::ReduceResidual(bool firstSweep)
+	{
+		sweepResidual = 0;
+		for (int t = 0; t < numThreads; t++)
+		{
+			sweepResidual = max(sweepResidual, h_residual[t * 16]);
+			h_residual[t * 16] = 0;
 		}
-		else
-			if (pplan->rank() == 0)
-			{
-				printf("\rerr = %.8f,", diffError);
-				fflush(stdout);
-			}
+		iterResidual = firstSweep ? sweepResidual : max(iterResidual, sweepResidual);
+	}
 
-		// clear cells for dynamic grid update
-		// prof.StartEvent();
-		// ClearOutterCells();
-		// prof.StopEvent("ClearLayer");
+	// profiler events of code that may run inside the time step team: only the master records them,
+	// every loop timed ends with a barrier, so the interval still covers the work of all threads
+	void AdiSolver3D::TeamStartEvent()
+	{
+		#pragma omp master
+		prof.StartEvent();
+	}
 
-		// swap current/next pointers 
-		TimeLayer3D *tmp = next;
-		next = cur;
-		cur = tmp;
+	void AdiSolver3D::TeamStopEvent(const char *name)
+	{
+		#pragma omp master
+		prof.StopEvent(name);
 	}
 
 	template<DirType dir>
-	void AdiSolver3D::CreateListSegments(int &numSeg, Segment3D *h_list, Segment3D **d_list, NodesBoundary3D **d_node_list, int dim1, int dim2, int dim3)
+	void AdiSolver3D::CreateListSegments(int &numSeg, Segment3D *h_list, NodesBoundary3D *h_node_list, Segment3D **d_list, NodesBoundary3D **d_node_list, int dim1, int dim2, int dim3)
 	{	
 		PARAplan *pplan = PARAplan::Instance();
 		int dimxNode = pplan->getLength1D();
 		int dimxNodeOffset = pplan->getOffset1D();
 
 		Segment3D *hh_list;
-		NodesBoundary3D *h_node_list;
 		NodesBoundary3D *hh_node_list;
 
 		switch (dir)
 		{
 		case X:
 			hh_list = new Segment3D[grid->dimy * grid->dimz * MAX_SEGS_PER_ROW];
-			h_node_list = new NodesBoundary3D[grid->dimy * grid->dimz * MAX_SEGS_PER_ROW];
 			hh_node_list = new NodesBoundary3D[grid->dimy * grid->dimz * MAX_SEGS_PER_ROW];
 			break;
 		case Y:
 			hh_list = new Segment3D[grid->dimx * grid->dimz * MAX_SEGS_PER_ROW];
-			h_node_list = new NodesBoundary3D[grid->dimx * grid->dimz * MAX_SEGS_PER_ROW];
 			hh_node_list = new NodesBoundary3D[grid->dimx * grid->dimz * MAX_SEGS_PER_ROW];
 			break;
 		case Z:
 			hh_list = new Segment3D[grid->dimx * grid->dimy * MAX_SEGS_PER_ROW];
-			h_node_list = new NodesBoundary3D[grid->dimx * grid->dimy * MAX_SEGS_PER_ROW];
 			hh_node_list = new NodesBoundary3D[grid->dimx * grid->dimy * MAX_SEGS_PER_ROW];
 			break;
 		}
@@ -429,10 +826,35 @@ namespace FluidSolver3D
 		}
 		grid->GenerateListSegments(numSeg, hh_list, dim1, dim2, dim3, dir, _nblockZ);	
 
-		if(backend == GPU)
-			grid->GenerateGridBoundaries(hh_node_list, numSeg, hh_list, transposeOpt);
+		grid->GenerateGridBoundaries(hh_node_list, numSeg, hh_list, transposeOpt);
 
 		numSeg = _nodeSplitListSegments<dir>(h_list, h_node_list, numSeg, hh_list, hh_node_list, dimxNode, dimxNodeOffset);
+
+#if SPIKE_SOLVER_ENABLE
+		if (backend == CPU && comuNumSegsBlZ[dir] == NULL && spike != NULL)
+			numSpike[dir] = SelectSpikeSegments(dir, numSeg, h_list, h_node_list);
+#endif
+
+		if (backend == CPU && comuNumSegsBlZ[dir] != NULL)
+		{
+			// the list is ordered by Z blocks, each block gets its own batches
+			int *numSegsBlZ = new int[_nblockZ];
+			_blockSplitListSegments(numSegsBlZ, comuNumSegsBlZ[dir], dim3, _nblockZ, numSeg, h_list);
+			delete [] numSegsBlZ;
+
+			if (h_order[dir] != NULL)
+			{
+				numBatches[dir] = 0;
+				for (int iblock = 0; iblock < _nblockZ; iblock++)
+				{
+					batchesBlZ[dir][iblock] = numBatches[dir];
+					numBatches[dir] = CreateBatches<dir>(comuNumSegsBlZ[dir][iblock], comuNumSegsBlZ[dir][iblock + 1], h_list, h_order[dir], h_batches[dir], numBatches[dir]);
+				}
+				batchesBlZ[dir][_nblockZ] = numBatches[dir];
+			}
+		}
+		else if (h_order[dir] != NULL)
+			numBatches[dir] = CreateBatches<dir>(0, numSeg - numSpike[dir], h_list, h_order[dir], h_batches[dir], 0);
 		
 		if (ifdebug)
 		{
@@ -468,7 +890,6 @@ namespace FluidSolver3D
 			}
 		}	
 		delete [] hh_node_list;
-		delete [] h_node_list;
 		delete [] hh_list;
 	}
 
@@ -553,12 +974,204 @@ template<DirType dir>
 	void AdiSolver3D::CreateSegments()
 	{
 		prof.StartEvent();
+		BuildSegments();
+		prof.StopEvent("CreateSegments");
+	}
 
-		CreateListSegments<X>(numSegs[X], h_listX, d_listX, d_node_listX, dimx, dimy, dimz);
-		CreateListSegments<Y>(numSegs[Y], h_listY, d_listY, d_node_listY, dimy, dimx, dimz);
-		CreateListSegments<Z>(numSegs[Z], h_listZ, d_listZ, d_node_listZ, dimz, dimx, dimy);
+	void AdiSolver3D::BuildSegments()
+	{
+		CreateListSegments<X>(numSegs[X], h_listX, h_node_listX, d_listX, d_node_listX, dimx, dimy, dimz);
+		CreateListSegments<Y>(numSegs[Y], h_listY, h_node_listY, d_listY, d_node_listY, dimy, dimx, dimz);
+		CreateListSegments<Z>(numSegs[Z], h_listZ, h_node_listZ, d_listZ, d_node_listZ, dimz, dimx, dimy);
 
-		prof.StopEvent("CreateSegments");
+		if (backend == CPU)
+		{
+			BalanceLoad(X);
+			BalanceLoad(Y);
+			BalanceLoad(Z);
+
+			// the error check visits the same nodes until the grid changes
+			if (h_divIndex != NULL) delete [] h_divIndex;
+			numDivIndex = cur->BuildDivIndex(grid, NULL);
+			h_divIndex = new int[numDivIndex];
+			cur->BuildDivIndex(grid, h_divIndex);
+
+#if INTERNAL_MERGE_ENABLE
+			BuildMergeIndex(X, numSegs[X], h_listX);
+			BuildMergeIndex(Y, numSegs[Y], h_listY);
+			BuildMergeIndex(Z, numSegs[Z], h_listZ);
+#endif
+		}
+	}
+
+	// the fused merge writes only the nodes of the segments, a NODE_IN run reaching the end of its row
+	// has no segment, so such nodes are listed per direction and merged apart before the layers are swapped
+	void AdiSolver3D::BuildMergeIndex(DirType dir, int numSeg, Segment3D *list)
+	{
+		int size = dimx * dimy * dimz;
+		int stride = (dir == X) ? dimy * dimz : ((dir == Y) ? dimz : 1);
+		unsigned char *covered = new unsigned char[size];
+		memset(covered, 0, size);
+		for (int s = 0; s < numSeg; s++)
+		{
+			int id = list[s].posx * dimy * dimz + list[s].posy * dimz + list[s].posz;
+			for (int t = 0; t < list[s].size; t++)
+				covered[id + t * stride] = 1;
+		}
+
+		const unsigned char *types = grid->GetTypesCPU();
+		int num = 0;
+		for (int id = 0; id < size; id++)
+			if (types[id] == NODE_IN && !covered[id]) num++;
+
+		if (h_mergeIndex[dir] != NULL) delete [] h_mergeIndex[dir];
+		h_mergeIndex[dir] = new int[num];
+		numMergeIndex[dir] = 0;
+		for (int id = 0; id < size; id++)
+			if (types[id] == NODE_IN && !covered[id]) h_mergeIndex[dir][numMergeIndex[dir]++] = id;
+		delete [] covered;
+	}
+
+	// same as MergeLayerTo over the nodes of BuildMergeIndex, the result goes to tempNext as in the fused merge
+	void AdiSolver3D::MergeUncovered(DirType dir, TimeLayer3D *temp, TimeLayer3D *next)
+	{
+		FTYPE *f_temp[4] = { &temp->U->elem(0, 0, 0), &temp->V->elem(0, 0, 0), &temp->W->elem(0, 0, 0), &temp->T->elem(0, 0, 0) };
+		FTYPE *f_next[4] = { &next->U->elem(0, 0, 0), &next->V->elem(0, 0, 0), &next->W->elem(0, 0, 0), &next->T->elem(0, 0, 0) };
+		FTYPE *f_merge[4] = { &tempNext->U->elem(0, 0, 0), &tempNext->V->elem(0, 0, 0), &tempNext->W->elem(0, 0, 0), &tempNext->T->elem(0, 0, 0) };
+		FTYPE res = 0;
+
+		for (int v = 0; v < 4; v++)
+			for (int n = 0; n < numMergeIndex[dir]; n++)
+			{
+				int id = h_mergeIndex[dir][n];
+				f_merge[v][id] = (f_temp[v][id] + f_next[v][id]) / 2;
+				FTYPE diff = f_merge[v][id] - f_temp[v][id];
+				res = max(res, (diff < 0) ? -diff : diff);
+			}
+
+		FTYPE &slot = h_residual[GetThreadNum() * 16];
+		slot = max(slot, res);
+	}
+
+	void AdiSolver3D::UpdateGrid(double time)
+	{
+		prof.StartEvent();
+		grid->Prepare(time);
+		prof.StopEvent("PrepareGrid");
+
+		// same types, same segments: the CPU boundary records are refreshed by UpdateBoundaries,
+		// while the GPU lists carry their boundary records and are always rebuilt
+		if (backend == CPU && !grid->HasDirtyRows())
+			return;
+
+		prof.StartEvent();
+		BuildSegments();
+		prof.StopEvent("UpdateSegments");
+	}
+
+	void AdiSolver3D::GetWorkRange(DirType dir, int iblock, int &first, int &last)
+	{
+		// work items are batches, or single segments if batching is off
+#if BATCHED_SOLVER_ENABLE
+		first = (iblock < 0) ? 0 : batchesBlZ[dir][iblock];
+		last = (iblock < 0) ? numBatches[dir] : batchesBlZ[dir][iblock + 1];
+#else
+		first = (iblock < 0) ? 0 : comuNumSegsBlZ[dir][iblock];
+		last = (iblock < 0) ? numSegs[dir] - numSpike[dir] : comuNumSegsBlZ[dir][iblock + 1];
+#endif
+	}
+
+	struct CostCmp
+	{
+		int *cost;
+		CostCmp(int *_cost) : cost(_cost) { }
+		bool operator()(int w1, int w2) const { return cost[w1] > cost[w2]; }
+	};
+
+	void AdiSolver3D::BalanceLoad(DirType dir)
+	{
+		// longest processing time first: items sorted by cost go to the least loaded thread,
+		// the cost of an item is the number of nodes in its segments
+		Segment3D *list = (dir == X) ? h_listX : ((dir == Y) ? h_listY : h_listZ);
+		int nblocks = (comuNumSegsBlZ[dir] != NULL) ? nblockZ : 1;
+		double maxImbalance = 1.0;
+
+		// the sweeps done with the old plan are counted before it is replaced
+		FlushWorkCounters(dir);
+
+		for (int iblock = 0; iblock < nblocks; iblock++)
+		{
+			int first, last;
+			GetWorkRange(dir, (nblocks > 1) ? iblock : -1, first, last);
+			int num = last - first;
+
+			int *cost = new int[num];
+			int *sorted = new int[num];
+			int *owner = new int[num];
+			for (int w = 0; w < num; w++)
+			{
+#if BATCHED_SOLVER_ENABLE
+				cost[w] = 0;
+				for (int s = h_batches[dir][first + w]; s < h_batches[dir][first + w + 1]; s++)
+					cost[w] += list[h_order[dir][s]].size;
+#else
+				cost[w] = list[first + w].size;
+#endif
+				sorted[w] = w;
+			}
+			std::sort(sorted, sorted + num, CostCmp(cost));
+
+			double *work = h_threadWork[dir] + iblock * numThreads;
+			int *threadFirst = h_threadFirst[dir] + iblock * (numThreads + 1);
+			for (int t = 0; t < numThreads; t++)
+			{
+				work[t] = 0.0;
+				threadFirst[t+1] = 0;
+			}
+
+			for (int i = 0; i < num; i++)
+			{
+				int w = sorted[i];
+				int t_min = 0;
+				for (int t = 1; t < numThreads; t++)
+					if (work[t] < work[t_min]) t_min = t;
+				owner[w] = t_min;
+				work[t_min] += cost[w];
+				threadFirst[t_min + 1]++;
+			}
+
+			// group items by thread, every thread starts from its most expensive item
+			threadFirst[0] = first;
+			for (int t = 0; t < numThreads; t++)
+				threadFirst[t+1] += threadFirst[t];
+			int *pos = new int[numThreads];
+			for (int t = 0; t < numThreads; t++) pos[t] = threadFirst[t];
+			for (int i = 0; i < num; i++)
+			{
+				int w = sorted[i];
+				h_schedule[dir][pos[owner[w]]++] = first + w;
+			}
+
+			double total = 0.0, heaviest = 0.0;
+			for (int t = 0; t < numThreads; t++)
+			{
+				total += work[t];
+				heaviest = max(heaviest, work[t]);
+			}
+			if (total > 0)
+				maxImbalance = max(maxImbalance, heaviest * numThreads / total);
+
+			delete [] pos;
+			delete [] owner;
+			delete [] sorted;
+			delete [] cost;
+		}
+
+		if (ifdebug)
+		{
+			printf("BalanceLoad: direction %d, %d threads, max/avg thread work = %.3f\n", dir, numThreads, maxImbalance);
+			fflush(stdout);
+		}
 	}
 
 	void AdiSolver3D::SolveDirection(DirType dir, FTYPE dt, int num_local, Segment3D *h_list, Segment3D **d_list, NodesBoundary3D **d_node_list, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next)
@@ -586,20 +1199,24 @@ template<DirType dir>
 
 		for (int it = 0; it < num_local; it++)
 		{
+			#pragma omp master
+			numIterLocal++;
+
 			switch( backend )
 			{
 			case CPU:
-				prof.StartEvent();
-				#pragma omp parallel default(none) firstprivate(dt, dir) shared(h_list, cur, temp, next)
+				TeamStartEvent();
+				switch (dir)
 				{
-					#pragma omp for
-					for (int s = 0; s < numSegs[dir]; s++)
-					{		
-						SolveSegment(dt, s, h_list[s], type_U, dir, cur, temp, next);
-						SolveSegment(dt, s, h_list[s], type_V, dir, cur, temp, next);
-						SolveSegment(dt, s, h_list[s], type_W, dir, cur, temp, next);
-						SolveSegment(dt, s, h_list[s], type_T, dir, cur, temp, next);			
-					}
+#if INTERNAL_MERGE_ENABLE
+				case X: SolveSegments_CPU<X>(dt, h_list, cur, temp, next, tempNext); break;
+				case Y: SolveSegments_CPU<Y>(dt, h_list, cur, temp, next, tempNext); break;
+				case Z: SolveSegments_CPU<Z>(dt, h_list, cur, temp, next, tempNext); break;
+#else
+				case X: SolveSegments_CPU<X>(dt, h_list, cur, temp, next); break;
+				case Y: SolveSegments_CPU<Y>(dt, h_list, cur, temp, next); break;
+				case Z: SolveSegments_CPU<Z>(dt, h_list, cur, temp, next); break;
+#endif
 				}
 				break;		
 			case GPU:
@@ -626,17 +1243,32 @@ template<DirType dir>
 
 			switch( dir )
 			{
-			case X: prof.StopEvent("SolveSegments_X"); break;
-			case Y: prof.StopEvent("SolveSegments_Y"); break;
-			case Z: prof.StopEvent("SolveSegments_Z"); break;
+			case X: TeamStopEvent("SolveSegments_X"); break;
+			case Y: TeamStopEvent("SolveSegments_Y"); break;
+			case Z: TeamStopEvent("SolveSegments_Z"); break;
 			}
 
+#if INTERNAL_MERGE_ENABLE
+			if (backend == CPU)
+			{
+				// the sweep has written the merged values to tempNext, it becomes the non-linear layer
+				#pragma omp single
+				{
+					MergeUncovered(dir, temp, next);
+					temp->SwapFields(tempNext);
+					ReduceResidual(dir == Z && it == 0);
+				}
+
+				// stop the local iterations once the layer has stopped changing, 
+				// sweepResidual is read after the barrier closing the single, so all threads agree
+				if (tolerance > 0 && sweepResidual < tolerance)
+					break;
+			}
+#else
 			switch (backend)
 			{
 			case CPU:
-#if !INTERNAL_MERGE_ENABLE
 			case GPU:
-#endif
 				if( dir_new == Z_as_Y )
 				{
 					// update non-linear layer
@@ -647,12 +1279,13 @@ template<DirType dir>
 				else
 				{
 					// update non-linear layer
-					prof.StartEvent();
+					TeamStartEvent();
 					next->MergeLayerTo(grid, temp, NODE_IN);
-					prof.StopEvent("MergeLayer");
+					TeamStopEvent("MergeLayer");
 				}
 				break;
 			}
+#endif
 		}
 
 		// transpose temp and next layers to normal order
@@ -667,8 +1300,32 @@ template<DirType dir>
 
 	void AdiSolver3D::SolveDirection_XY(FTYPE dt, int num_local, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *half, TimeLayer3D *next)
 	{
-		if (backend != GPU)
-			throw std::logic_error("Not Implemented");
+		if (backend == CPU)
+		{
+			// Y then X sweeps block by block along Z, so the slab stays in cache between the two
+			TeamStartEvent();
+			for (int iblock = 0; iblock < nblockZ; iblock++)
+			{
+				int zStart = iblock * (dimz / nblockZ);
+				int zEnd = (iblock == nblockZ - 1) ? dimz : zStart + dimz / nblockZ;
+
+				for (int it = 0; it < num_local; it++)
+				{
+					SolveSegments_CPU<Y>(dt, h_listY, cur, temp, half, NULL, iblock);
+					half->MergeLayerBlockTo(grid, temp, NODE_IN, zStart, zEnd);
+				}
+				for (int it = 0; it < num_local; it++)
+				{
+					SolveSegments_CPU<X>(dt, h_listX, half, temp, next, NULL, iblock);
+					next->MergeLayerBlockTo(grid, temp, NODE_IN, zStart, zEnd);
+				}
+			}
+			TeamStopEvent("SolveSegments_XY");
+
+			#pragma omp master
+			numIterLocal += 2 * num_local;
+			return;
+		}
 
 		prof.StartEvent(); // sync halos once
 		temp->syncHalos(mpi_buf);
@@ -684,127 +1341,692 @@ template<DirType dir>
 		//prof.StopEvent("syncHalos_XY");
 	}
 
-	void AdiSolver3D::SolveSegment(FTYPE dt, int id, Segment3D seg, VarType var, DirType dir, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next)
+	// iblock >= 0 solves only the segments of that Z block,
+	// merge != NULL also writes the merged non-linear layer, see UpdateSegment
+	template<DirType dir>
+	void AdiSolver3D::SolveSegments_CPU(FTYPE dt, Segment3D *h_list, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next, TimeLayer3D *merge, int iblock)
+	{
+		NodesBoundary3D *h_node_list = (dir == X) ? h_node_listX : ((dir == Y) ? h_node_listY : h_node_listZ);
+		int *threadFirst = h_threadFirst[dir] + max(iblock, 0) * (numThreads + 1);
+
+		// the long segments at the end of the list follow the bins, shared by the whole team
+		int spikeFirst = numSegs[dir] - numSpike[dir];
+
+		if (InParallelRegion())
+		{
+			// inside the time step team: the merge that follows reads what other threads wrote
+			SolveBins_CPU<dir>(dt, h_list, h_node_list, threadFirst, cur, temp, next, merge);
+			SolveSpikes_CPU<dir>(dt, h_list, h_node_list, spikeFirst, numSegs[dir], cur, temp, next, merge);
+			#pragma omp barrier
+		}
+		else
+		{
+			#pragma omp parallel default(none) firstprivate(dt, spikeFirst) shared(h_list, h_node_list, threadFirst, cur, temp, next, merge)
+			{
+				SolveBins_CPU<dir>(dt, h_list, h_node_list, threadFirst, cur, temp, next, merge);
+				SolveSpikes_CPU<dir>(dt, h_list, h_node_list, spikeFirst, numSegs[dir], cur, temp, next, merge);
+			}
+		}
+
+#if PROFILE_ENABLE
+		// every Z block is swept as often as the first one
+		#pragma omp master
+		if (iblock <= 0) numSweeps[dir]++;
+#endif
+	}
+
+	// planned work of each thread in grid nodes, times the sweeps done with the plan
+	void AdiSolver3D::FlushWorkCounters(DirType dir)
+	{
+#if PROFILE_ENABLE
+		if (h_threadWork[dir] == NULL || numSweeps[dir] == 0) return;
+
+		int nblocks = (comuNumSegsBlZ[dir] != NULL) ? nblockZ : 1;
+		for (int t = 0; t < numThreads; t++)
+		{
+			double work = 0;
+			for (int iblock = 0; iblock < nblocks; iblock++)
+				work += h_threadWork[dir][iblock * numThreads + t];
+
+			char name[32];
+			sprintf(name, "Work_%c_thread%i", 'X' + dir, t);
+			prof.AddCounter(name, work * numSweeps[dir]);
+		}
+		numSweeps[dir] = 0;
+#endif
+	}
+
+	// the bins of the load balancing plan, called by every thread of a team
+	template<DirType dir>
+	void AdiSolver3D::SolveBins_CPU(FTYPE dt, Segment3D *h_list, NodesBoundary3D *h_node_list, int *threadFirst, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next, TimeLayer3D *merge)
+	{
+		// bins are planned for numThreads, a smaller team picks up the bins of the missing threads
+		for (int t = GetThreadNum(); t < numThreads; t += GetNumThreads())
+			for (int w = threadFirst[t]; w < threadFirst[t+1]; w++)
+			{
+#if BATCHED_SOLVER_ENABLE
+				int bt = h_schedule[dir][w];
+				int *order = h_order[dir] + h_batches[dir][bt];
+				int count = h_batches[dir][bt+1] - h_batches[dir][bt];
+#if BLOCKED_SWEEP_ENABLE
+				if (dir != Z)
+				{
+					SolvePanel<dir, type_U>(dt, h_list, h_node_list, order, count, cur, temp, next, merge);
+					SolvePanel<dir, type_T>(dt, h_list, h_node_list, order, count, cur, temp, next, merge);
+					continue;
+				}
+#endif
+				SolveBatch<dir, type_U>(dt, h_list, h_node_list, order, count, cur, temp, next, merge);
+				SolveBatch<dir, type_T>(dt, h_list, h_node_list, order, count, cur, temp, next, merge);
+#else
+				int s = h_schedule[dir][w];
+#if FUSED_VEL_ENABLE
+				SolveSegment_Vel<dir>(dt, h_list[s], h_node_list[s], cur, temp, next, merge);
+#else
+				SolveSegment<dir, type_U>(dt, h_list[s], h_node_list[s], cur, temp, next, merge);
+				SolveSegment<dir, type_V>(dt, h_list[s], h_node_list[s], cur, temp, next, merge);
+				SolveSegment<dir, type_W>(dt, h_list[s], h_node_list[s], cur, temp, next, merge);
+#endif
+				SolveSegment<dir, type_T>(dt, h_list[s], h_node_list[s], cur, temp, next, merge);			
+#endif
+			}
+	}
+
+	// partition (SPIKE) method, called by every thread of a team: each thread solves one part of the segment
+	// with its coupling to the neighbouring parts moved into two extra right-hand sides, the spikes v and w,
+	// then a single thread solves the small system of the part interfaces and every part is corrected
+	template<DirType dir>
+	void AdiSolver3D::SolveSpikes_CPU(FTYPE dt, Segment3D *h_list, NodesBoundary3D *h_node_list, int first, int last, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next, TimeLayer3D *merge)
+	{
+		int t = GetThreadNum();
+		for (int s = first; s < last; s++)
+		{
+			int n = h_list[s].size;
+			int parts = max(1, min(GetNumThreads(), n / SPIKE_MIN_PART));
+
+			if (t < parts)
+			{
+				SolveSpikePart<dir, type_U>(dt, h_list[s], h_node_list[s], t, parts, cur, temp);
+				SolveSpikePart<dir, type_T>(dt, h_list[s], h_node_list[s], t, parts, cur, temp);
+			}
+			#pragma omp barrier
+
+			#pragma omp single
+			{
+				SolveSpikeInterfaces<type_U>(n, parts);
+				SolveSpikeInterfaces<type_T>(n, parts);
+			}
+
+			if (t < parts)
+			{
+				UpdateSpikePart<dir, type_U>(h_list[s], t, parts, next, temp, merge);
+				UpdateSpikePart<dir, type_T>(h_list[s], t, parts, next, temp, merge);
+			}
+			#pragma omp barrier
+		}
+	}
+
+	// U, V, W share one matrix and T has its own, var = type_U or type_T selects the arena
+	template<VarType var>
+	void AdiSolver3D::GetSpikeArena(FTYPE *&a, FTYPE *&b, FTYPE *&c, FTYPE *&v, FTYPE *&w, FTYPE **d, FTYPE *&band, FTYPE **z)
+	{
+		const int nrhs = SOLVER_VAR_NUM - 1;
+		const int m = 2 * numThreads;
+		FTYPE *base = spike + ((var == type_T) ? 1 : 0) * (5 + nrhs) * scratchStride;
+		FTYPE *reduced = spikeReduced + ((var == type_T) ? 1 : 0) * (5 + nrhs) * m;
+
+		a = base;
+		b = base + scratchStride;
+		c = base + 2 * scratchStride;
+		v = base + 3 * scratchStride;
+		w = base + 4 * scratchStride;
+		band = reduced;
+		for (int r = 0; r < nrhs; r++)
+		{
+			d[r] = base + (5 + r) * scratchStride;
+			z[r] = reduced + (5 + r) * m;
+		}
+	}
+
+	// builds and solves rows [lo, hi) of the segment as a system of its own:
+	// the coefficients a[lo] and c[hi-1] coupling it to the neighbouring parts give the spikes v and w
+	template<DirType dir, VarType var>
+	void AdiSolver3D::SolveSpikePart(FTYPE dt, Segment3D seg, const NodesBoundary3D &bound, int part, int parts, TimeLayer3D *cur, TimeLayer3D *temp)
 	{
+		const int nvars = (var == type_T) ? 1 : 3;
+		FTYPE *a, *b, *c, *v, *w, *band, *d[SOLVER_VAR_NUM], *z[SOLVER_VAR_NUM];
+		GetSpikeArena<var>(a, b, c, v, w, d, band, z);
+
 		int n = seg.size;
+		int lo = part * n / parts;
+		int hi = (part + 1) * n / parts;
 
-		int max_n = max(dimx, max(dimy, dimz));
-		FTYPE *a = this->a + id * max_n;
-		FTYPE *b = this->b + id * max_n;
-		FTYPE *c = this->c + id * max_n;
-		FTYPE *d = this->d + id * max_n;
-		FTYPE *x = this->x + id * max_n;
+		if (lo == 0)
+		{
+			ApplyBC0<var>(bound.first, b[0], c[0], d[0][0]);
+			if (nvars == 3)
+			{
+				ApplyBC0<type_V>(bound.first, b[0], c[0], d[1][0]);
+				ApplyBC0<type_W>(bound.first, b[0], c[0], d[2][0]);
+			}
+		}
+		if (hi == n)
+		{
+			ApplyBC1<var>(bound.last, a[n-1], b[n-1], d[0][n-1]);
+			if (nvars == 3)
+			{
+				ApplyBC1<type_V>(bound.last, a[n-1], b[n-1], d[1][n-1]);
+				ApplyBC1<type_W>(bound.last, a[n-1], b[n-1], d[2][n-1]);
+			}
+		}
 
-		ApplyBC0(seg.posx, seg.posy, seg.posz, var, b[0], c[0], d[0]);
-		ApplyBC1(seg.endx, seg.endy, seg.endz, var, a[n-1], b[n-1], d[n-1]);
-		BuildMatrix(dt, seg.posx, seg.posy, seg.posz, var, dir, a, b, c, d, n, cur, temp);
+		// inner rows: BuildMatrix fills rows 1..m-2 of a window that starts one row earlier
+		int first = max(lo, 1);
+		int last = min(hi, n-1);
+		if (first < last)
+		{
+			int base = first - 1;
+			int m = last - first + 2;
+			int i = seg.posx + ((dir == X) ? base : 0);
+			int j = seg.posy + ((dir == Y) ? base : 0);
+			int k = seg.posz + ((dir == Z) ? base : 0);
+
+			BuildMatrix<dir, var>(dt, i, j, k, a + base, b + base, c + base, d[0] + base, m, cur, temp);
+			if (nvars == 3)
+			{
+				BuildRHS<dir, type_V>(dt, i, j, k, d[1] + base, m, cur, temp);
+				BuildRHS<dir, type_W>(dt, i, j, k, d[2] + base, m, cur, temp);
+			}
+		}
+
+		for (int p = lo; p < hi; p++)
+			v[p] = w[p] = 0.0;
+		if (part > 0) v[lo] = a[lo];
+		if (part < parts-1) w[hi-1] = c[hi-1];
+
+		// solved in place, the solutions y of the variables and the spikes overwrite their right-hand sides
+		FTYPE *rhs[SOLVER_VAR_NUM + 1];
+		for (int r = 0; r < nvars; r++)
+			rhs[r] = d[r] + lo;
+		rhs[nvars] = v + lo;
+		rhs[nvars + 1] = w + lo;
+		SolveTridiagonal(a + lo, b + lo, c + lo, rhs, rhs, hi - lo, nvars + 2);
+	}
+
+	// the unknowns are the last row of part q (L_q) and the first row of part q+1 (F_q+1), ordered L_0, F_1, L_1, ...:
+	// inside part q the solution is x = y - v * L_q-1 - w * F_q+1, written at the interfaces this is pentadiagonal
+	template<VarType var>
+	void AdiSolver3D::SolveSpikeInterfaces(int n, int parts)
+	{
+		const int nvars = (var == type_T) ? 1 : 3;
+		FTYPE *a, *b, *c, *v, *w, *band, *d[SOLVER_VAR_NUM], *z[SOLVER_VAR_NUM];
+		GetSpikeArena<var>(a, b, c, v, w, d, band, z);
+
+		for (int q = 0; q < parts-1; q++)
+		{
+			int edge = (q + 1) * n / parts;
+			FTYPE *rowL = band + 2 * q * 5 + 2;
+			FTYPE *rowF = band + (2 * q + 1) * 5 + 2;
+
+			rowL[-2] = v[edge-1]; rowL[-1] = 0.0; rowL[0] = 1.0; rowL[1] = w[edge-1]; rowL[2] = 0.0;
+			rowF[-2] = 0.0; rowF[-1] = v[edge]; rowF[0] = 1.0; rowF[1] = 0.0; rowF[2] = w[edge];
+			for (int r = 0; r < nvars; r++)
+			{
+				z[r][2 * q] = d[r][edge-1];
+				z[r][2 * q + 1] = d[r][edge];
+			}
+		}
+
+		SolvePentadiagonal(band, z, 2 * (parts-1), nvars);
+	}
+
+	template<DirType dir, VarType var>
+	void AdiSolver3D::UpdateSpikePart(Segment3D seg, int part, int parts, TimeLayer3D *next, TimeLayer3D *temp, TimeLayer3D *merge)
+	{
+		const int nvars = (var == type_T) ? 1 : 3;
+		FTYPE *a, *b, *c, *v, *w, *band, *d[SOLVER_VAR_NUM], *z[SOLVER_VAR_NUM];
+		GetSpikeArena<var>(a, b, c, v, w, d, band, z);
+
+		int lo = part * seg.size / parts;
+		int hi = (part + 1) * seg.size / parts;
+
+		for (int r = 0; r < nvars; r++)
+		{
+			FTYPE left = (part > 0) ? z[r][2 * (part-1)] : 0;
+			FTYPE right = (part < parts-1) ? z[r][2 * part + 1] : 0;
+			for (int p = lo; p < hi; p++)
+				d[r][p] = d[r][p] - v[p] * left - w[p] * right;
+		}
+
+		Segment3D sub = seg;
+		sub.posx += (dir == X) ? lo : 0;
+		sub.posy += (dir == Y) ? lo : 0;
+		sub.posz += (dir == Z) ? lo : 0;
+		sub.size = hi - lo;
+
+		UpdateSegment<dir, var>(d[0] + lo, sub, next, temp, merge);
+		if (nvars == 3)
+		{
+			UpdateSegment<dir, type_V>(d[1] + lo, sub, next, temp, merge);
+			UpdateSegment<dir, type_W>(d[2] + lo, sub, next, temp, merge);
+		}
+	}
+
+	template<DirType dir, VarType var>
+	void AdiSolver3D::SolveSegment(FTYPE dt, Segment3D seg, const NodesBoundary3D &bound, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next, TimeLayer3D *merge)
+	{
+		int n = seg.size;
+
+		int offset = GetThreadNum() * scratchStride;
+		FTYPE *a = this->a + offset;
+		FTYPE *b = this->b + offset;
+		FTYPE *c = this->c + offset;
+		FTYPE *d = this->d + offset * SOLVER_VAR_NUM;
+		FTYPE *x = this->x + offset * SOLVER_VAR_NUM;
+
+		ApplyBC0<var>(bound.first, b[0], c[0], d[0]);
+		ApplyBC1<var>(bound.last, a[n-1], b[n-1], d[n-1]);
+		BuildMatrix<dir, var>(dt, seg.posx, seg.posy, seg.posz, a, b, c, d, n, cur, temp);
 		
-		SolveTridiagonal(a, b, c, d, x, n);
+		if (mixedPrecision)
+		{
+			double *cw, *dw[1];
+			GetWork(cw, dw, 1);
+			SolveTridiagonal<double>(a, b, c, d, x, n, cw, dw[0]);
+		}
+		else
+			SolveTridiagonal(a, b, c, d, x, n);
 		
-		UpdateSegment(x, seg, var, next);
+		UpdateSegment<dir, var>(x, seg, next, temp, merge);
 	}
 
-	void AdiSolver3D::UpdateSegment(FTYPE *x, Segment3D seg, VarType var, TimeLayer3D *layer)
+	template<DirType dir>
+	void AdiSolver3D::SolveSegment_Vel(FTYPE dt, Segment3D seg, const NodesBoundary3D &bound, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next, TimeLayer3D *merge)
 	{
-		int i = seg.posx;
-		int j = seg.posy;
-		int k = seg.posz;
+		// U, V and W share the same matrix: it depends only on the velocity along dir and v_vis
+		int n = seg.size;
 
-		for (int t = 0; t < seg.size; t++)
+		int offset = GetThreadNum() * scratchStride;
+		FTYPE *a = this->a + offset;
+		FTYPE *b = this->b + offset;
+		FTYPE *c = this->c + offset;
+		FTYPE *d[3], *x[3];
+		for (int r = 0; r < 3; r++)
 		{
-			switch (var)
+			d[r] = this->d + offset * SOLVER_VAR_NUM + r * scratchStride;
+			x[r] = this->x + offset * SOLVER_VAR_NUM + r * scratchStride;
+		}
+
+		ApplyBC0<type_U>(bound.first, b[0], c[0], d[0][0]);
+		ApplyBC0<type_V>(bound.first, b[0], c[0], d[1][0]);
+		ApplyBC0<type_W>(bound.first, b[0], c[0], d[2][0]);
+		ApplyBC1<type_U>(bound.last, a[n-1], b[n-1], d[0][n-1]);
+		ApplyBC1<type_V>(bound.last, a[n-1], b[n-1], d[1][n-1]);
+		ApplyBC1<type_W>(bound.last, a[n-1], b[n-1], d[2][n-1]);
+
+		BuildMatrix<dir, type_U>(dt, seg.posx, seg.posy, seg.posz, a, b, c, d[0], n, cur, temp);
+		BuildRHS<dir, type_V>(dt, seg.posx, seg.posy, seg.posz, d[1], n, cur, temp);
+		BuildRHS<dir, type_W>(dt, seg.posx, seg.posy, seg.posz, d[2], n, cur, temp);
+
+		if (mixedPrecision)
+		{
+			double *cw, *dw[3];
+			GetWork(cw, dw, 3);
+			SolveTridiagonal<double>(a, b, c, d, x, n, 3, cw, dw);
+		}
+		else
+			SolveTridiagonal(a, b, c, d, x, n, 3);
+
+		UpdateSegment<dir, type_U>(x[0], seg, next, temp, merge);
+		UpdateSegment<dir, type_V>(x[1], seg, next, temp, merge);
+		UpdateSegment<dir, type_W>(x[2], seg, next, temp, merge);
+	}
+
+	template<DirType dir, VarType var>
+	void AdiSolver3D::SolveBatch(FTYPE dt, Segment3D *h_list, NodesBoundary3D *h_node_list, int *order, int count, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next, TimeLayer3D *merge)
+	{
+		// type_U solves U, V and W with one matrix, type_T solves T alone
+		const int lanes = SOLVER_BATCH_SIZE;
+		const int nvars = (var == type_T) ? 1 : 3;
+
+		// each segment is assembled in the per-segment arena, then interleaved into the batch arena
+		int offset = GetThreadNum() * scratchStride;
+		FTYPE *a = this->a + offset;
+		FTYPE *b = this->b + offset;
+		FTYPE *c = this->c + offset;
+		FTYPE *a_bt = a_batch + offset * lanes;
+		FTYPE *b_bt = b_batch + offset * lanes;
+		FTYPE *c_bt = c_batch + offset * lanes;
+		FTYPE *d[SOLVER_VAR_NUM], *x[SOLVER_VAR_NUM];
+		FTYPE *d_bt[SOLVER_VAR_NUM], *x_bt[SOLVER_VAR_NUM];
+		for (int r = 0; r < nvars; r++)
+		{
+			d[r] = this->d + offset * SOLVER_VAR_NUM + r * scratchStride;
+			x[r] = this->x + offset * SOLVER_VAR_NUM + r * scratchStride;
+			d_bt[r] = d_batch + (offset * SOLVER_VAR_NUM + r * scratchStride) * lanes;
+			x_bt[r] = x_batch + (offset * SOLVER_VAR_NUM + r * scratchStride) * lanes;
+		}
+
+		int num = 0;
+		for (int l = 0; l < count; l++)
+			num = max(num, h_list[order[l]].size);
+
+		for (int l = 0; l < lanes; l++)
+		{
+			int n = 0;
+			if (l < count)
+			{
+				Segment3D &seg = h_list[order[l]];
+				NodesBoundary3D &bound = h_node_list[order[l]];
+				n = seg.size;
+
+				ApplyBC0<var>(bound.first, b[0], c[0], d[0][0]);
+				ApplyBC1<var>(bound.last, a[n-1], b[n-1], d[0][n-1]);
+				BuildMatrix<dir, var>(dt, seg.posx, seg.posy, seg.posz, a, b, c, d[0], n, cur, temp);
+				if (nvars == 3)
+				{
+					ApplyBC0<type_V>(bound.first, b[0], c[0], d[1][0]);
+					ApplyBC1<type_V>(bound.last, a[n-1], b[n-1], d[1][n-1]);
+					BuildRHS<dir, type_V>(dt, seg.posx, seg.posy, seg.posz, d[1], n, cur, temp);
+
+					ApplyBC0<type_W>(bound.first, b[0], c[0], d[2][0]);
+					ApplyBC1<type_W>(bound.last, a[n-1], b[n-1], d[2][n-1]);
+					BuildRHS<dir, type_W>(dt, seg.posx, seg.posy, seg.posz, d[2], n, cur, temp);
+				}
+				a[0] = 0.0;
+				c[n-1] = 0.0;
+			}
+
+			for (int i = 0; i < n; i++)
 			{
-			case type_U: layer->U->elem(i, j, k) = x[t]; break;
-			case type_V: layer->V->elem(i, j, k) = x[t]; break;
-			case type_W: layer->W->elem(i, j, k) = x[t]; break;
-			case type_T: layer->T->elem(i, j, k) = x[t]; break;
+				a_bt[i * lanes + l] = a[i];
+				b_bt[i * lanes + l] = b[i];
+				c_bt[i * lanes + l] = c[i];
+				for (int r = 0; r < nvars; r++)
+					d_bt[r][i * lanes + l] = d[r][i];
 			}
 
-			switch (seg.dir)
+			// pad with identity rows
+			for (int i = n; i < num; i++)
 			{
-			case X: i++; break;
-			case Y: j++; break;
-			case Z: k++; break;
+				a_bt[i * lanes + l] = 0.0;
+				b_bt[i * lanes + l] = 1.0;
+				c_bt[i * lanes + l] = 0.0;
+				for (int r = 0; r < nvars; r++)
+					d_bt[r][i * lanes + l] = 0.0;
+			}
+		}
+
+		if (mixedPrecision)
+		{
+			double *cw, *dw[SOLVER_VAR_NUM];
+			GetWork(cw, dw, nvars);
+			SolveTridiagonalBatch<lanes, double>(a_bt, b_bt, c_bt, d_bt, x_bt, num, nvars, cw, dw);
+		}
+		else
+			SolveTridiagonalBatch<lanes>(a_bt, b_bt, c_bt, d_bt, x_bt, num, nvars);
+
+		for (int l = 0; l < count; l++)
+		{
+			Segment3D &seg = h_list[order[l]];
+			for (int r = 0; r < nvars; r++)
+				for (int i = 0; i < seg.size; i++)
+					x[r][i] = x_bt[r][i * lanes + l];
+
+			UpdateSegment<dir, var>(x[0], seg, next, temp, merge);
+			if (nvars == 3)
+			{
+				UpdateSegment<dir, type_V>(x[1], seg, next, temp, merge);
+				UpdateSegment<dir, type_W>(x[2], seg, next, temp, merge);
 			}
 		}
 	}
 
-	void AdiSolver3D::BuildMatrix(FTYPE dt, int i, int j, int k, VarType var, DirType dir, FTYPE *a, FTYPE *b, FTYPE *c, FTYPE *d, int n, TimeLayer3D *cur, TimeLayer3D *temp)
+	template<DirType dir, VarType var>
+	void AdiSolver3D::SolvePanel(FTYPE dt, Segment3D *h_list, NodesBoundary3D *h_node_list, int *order, int count, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next, TimeLayer3D *merge)
 	{
-		FTYPE vis_dx2, vis_dy2, vis_dz2;
-		FTYPE dx = cur->dx;
-		FTYPE dy = cur->dy;
-		FTYPE dz = cur->dz;
+		// segments of a tile are neighbours along Z and have the same size: the matrices are
+		// gathered straight into the interleaved panels and scattered back the same way
+		const int lanes = SOLVER_BATCH_SIZE;
+		const int nvars = (var == type_T) ? 1 : 3;
+
+		int offset = GetThreadNum() * scratchStride * lanes;
+		FTYPE *a = a_batch + offset;
+		FTYPE *b = b_batch + offset;
+		FTYPE *c = c_batch + offset;
+		FTYPE *d[SOLVER_VAR_NUM], *x[SOLVER_VAR_NUM];
+		for (int r = 0; r < nvars; r++)
+		{
+			d[r] = d_batch + offset * SOLVER_VAR_NUM + r * scratchStride * lanes;
+			x[r] = x_batch + offset * SOLVER_VAR_NUM + r * scratchStride * lanes;
+		}
+
+		Segment3D &first = h_list[order[0]];
+		int n = first.size;
+
+		for (int l = 0; l < count; l++)
+		{
+			NodesBoundary3D &bound = h_node_list[order[l]];
+			int last = (n-1) * lanes + l;
+
+			ApplyBC0<var>(bound.first, b[l], c[l], d[0][l]);
+			ApplyBC1<var>(bound.last, a[last], b[last], d[0][last]);
+			if (nvars == 3)
+			{
+				ApplyBC0<type_V>(bound.first, b[l], c[l], d[1][l]);
+				ApplyBC1<type_V>(bound.last, a[last], b[last], d[1][last]);
+				ApplyBC0<type_W>(bound.first, b[l], c[l], d[2][l]);
+				ApplyBC1<type_W>(bound.last, a[last], b[last], d[2][last]);
+			}
+			a[l] = 0.0;
+			c[last] = 0.0;
+		}
+
+		// unused lanes of a partial tile are identity systems
+		for (int l = count; l < lanes; l++)
+			for (int i = 0; i < n; i++)
+			{
+				a[i * lanes + l] = 0.0;
+				b[i * lanes + l] = 1.0;
+				c[i * lanes + l] = 0.0;
+				for (int r = 0; r < nvars; r++)
+					d[r][i * lanes + l] = 0.0;
+			}
+
+		BuildMatrix<dir, var>(dt, first.posx, first.posy, first.posz, a, b, c, d[0], n, cur, temp, count, lanes);
+		if (nvars == 3)
+		{
+			BuildRHS<dir, type_V>(dt, first.posx, first.posy, first.posz, d[1], n, cur, temp, count, lanes);
+			BuildRHS<dir, type_W>(dt, first.posx, first.posy, first.posz, d[2], n, cur, temp, count, lanes);
+		}
+
+		if (mixedPrecision)
+		{
+			double *cw, *dw[SOLVER_VAR_NUM];
+			GetWork(cw, dw, nvars);
+			SolveTridiagonalBatch<lanes, double>(a, b, c, d, x, n, nvars, cw, dw);
+		}
+		else
+			SolveTridiagonalBatch<lanes>(a, b, c, d, x, n, nvars);
+
+		UpdateSegment<dir, var>(x[0], first, next, temp, merge, count, lanes);
+		if (nvars == 3)
+		{
+			UpdateSegment<dir, type_V>(x[1], first, next, temp, merge, count, lanes);
+			UpdateSegment<dir, type_W>(x[2], first, next, temp, merge, count, lanes);
+		}
+	}
+
+	// per-thread double arenas for the recurrence of the mixed precision mode
+	void AdiSolver3D::GetWork(double *&cw, double **dw, int nrhs)
+	{
+		int offset = GetThreadNum() * scratchStride * SOLVER_BATCH_SIZE;
+		cw = c_work + offset;
+		for (int r = 0; r < nrhs; r++)
+			dw[r] = d_work + offset * SOLVER_VAR_NUM + r * scratchStride * SOLVER_BATCH_SIZE;
+	}
+
+	// distance between neighbouring nodes along dir
+	template<DirType dir>
+	static inline int DirStride(TimeLayer3D *layer)
+	{
+		switch (dir)
+		{
+		case X: return layer->dimy * layer->dimz;
+		case Y: return layer->dimz;
+		default: return 1;
+		}
+	}
+
+	template<VarType var>
+	static inline ScalarField3D *GetField(TimeLayer3D *layer)
+	{
+		switch (var)
+		{
+		case type_U: return layer->U;
+		case type_V: return layer->V;
+		case type_W: return layer->W;
+		default: return layer->T;
+		}
+	}
+
+	// width > 1 writes a panel of segments which are neighbours along Z, stored as x[t * ld + l];
+	// merge != NULL fuses the non-linear layer update: merge = (temp + x) / 2 on NODE_IN nodes,
+	// the inner nodes of a segment are always NODE_IN, only its ends are looked up in the grid
+	template<DirType dir, VarType var>
+	void AdiSolver3D::UpdateSegment(FTYPE *x, Segment3D seg, TimeLayer3D *layer, TimeLayer3D *temp, TimeLayer3D *merge, int width, int ld)
+	{
+		FTYPE *f = &GetField<var>(layer)->elem(seg.posx, seg.posy, seg.posz);
+		const int stride = DirStride<dir>(layer);
+
+		// X is the last sweep of a global iteration, its velocities bound those of the new layer
+		if (dir == X && var != type_T)
+		{
+			FTYPE vmax = 0;
+			for (int t = 0; t < seg.size; t++)
+				for (int l = 0; l < width; l++)
+				{
+					FTYPE v = x[t * ld + l];
+					vmax = max(vmax, (v < 0) ? -v : v);
+				}
+			FTYPE &slot = h_maxVel[GetThreadNum() * 16 + var];
+			slot = max(slot, vmax);
+		}
+
+		if (merge == NULL)
+		{
+			for (int t = 0; t < seg.size; t++)
+				for (int l = 0; l < width; l++)
+					f[t * stride + l] = x[t * ld + l];
+			return;
+		}
+
+		FTYPE *f_temp = &GetField<var>(temp)->elem(seg.posx, seg.posy, seg.posz);
+		FTYPE *f_merge = &GetField<var>(merge)->elem(seg.posx, seg.posy, seg.posz);
+		const unsigned char *types = grid->GetTypesCPU() + (seg.posx * layer->dimy + seg.posy) * layer->dimz + seg.posz;
+		FTYPE res = 0;
+
+		for (int t = 0; t < seg.size; t++)
+		{
+			bool inner = (t > 0) && (t < seg.size - 1);
+			for (int l = 0; l < width; l++)
+			{
+				int id = t * stride + l;
+				f[id] = x[t * ld + l];
+				if (inner || types[id] == NODE_IN)
+				{
+					f_merge[id] = (f_temp[id] + f[id]) / 2;
+					FTYPE diff = f_merge[id] - f_temp[id];
+					res = max(res, (diff < 0) ? -diff : diff);
+				}
+			}
+		}
+
+		// the residual of the sweep is the max change of the non-linear layer
+		FTYPE &slot = h_residual[GetThreadNum() * 16];
+		slot = max(slot, res);
+	}
+
+	template<DirType dir, VarType var>
+	void AdiSolver3D::BuildMatrix(FTYPE dt, int i, int j, int k, FTYPE *a, FTYPE *b, FTYPE *c, FTYPE *d, int n, TimeLayer3D *cur, TimeLayer3D *temp, int width, int ld)
+	{
+		FTYPE h, vis_dh2;
+		FTYPE *vel;
+		switch (dir)
+		{
+		case X: h = cur->dx; vel = &temp->U->elem(i, j, k); break;
+		case Y: h = cur->dy; vel = &temp->V->elem(i, j, k); break;
+		case Z: h = cur->dz; vel = &temp->W->elem(i, j, k); break;
+		}
 
 		switch (var)
 		{
 		case type_U:
 		case type_V:
 		case type_W:
-			vis_dx2 = params.v_vis / (dx * dx);
-			vis_dy2 = params.v_vis / (dy * dy);
-			vis_dz2 = params.v_vis / (dz * dz);
+			vis_dh2 = params.v_vis / (h * h);
 			break;
 		case type_T:
-			vis_dx2 = params.t_vis / (dx * dx);
-			vis_dy2 = params.t_vis / (dy * dy);
-			vis_dz2 = params.t_vis / (dz * dz);
+			vis_dh2 = params.t_vis / (h * h);
 			break;
 		}
+
+		const int stride = DirStride<dir>(temp);
 		
 		for (int p = 1; p < n-1; p++)
-		{
-			switch (dir)
+			for (int l = 0; l < width; l++)
 			{
-			case X:		
-				a[p] = - temp->U->elem(i+p, j, k) / (2 * dx) - vis_dx2; 
-				b[p] = 3 / dt  +  2 * vis_dx2; 
-				c[p] = temp->U->elem(i+p, j, k) / (2 * dx) - vis_dx2; 
-				
-				switch (var)	
-				{
-				case type_U: d[p] = cur->U->elem(i+p, j, k) * 3 / dt - params.v_T * temp->T->d_x(i+p, j, k); break;
-				case type_V: d[p] = cur->V->elem(i+p, j, k) * 3 / dt; break;
-				case type_W: d[p] = cur->W->elem(i+p, j, k) * 3 / dt; break;
-				case type_T: d[p] = cur->T->elem(i+p, j, k) * 3 / dt + params.t_phi * temp->DissFuncX(i+p, j, k); break;
-				}	
-				break;
+				a[p * ld + l] = - vel[p * stride + l] / (2 * h) - vis_dh2; 
+				b[p * ld + l] = 3 / dt  +  2 * vis_dh2; 
+				c[p * ld + l] = vel[p * stride + l] / (2 * h) - vis_dh2; 
+			}
 
-			case Y:
-				a[p] = - temp->V->elem(i, j+p, k) / (2 * dy) - vis_dy2; 
-				b[p] = 3 / dt  +  2 * vis_dy2; 
-				c[p] = temp->V->elem(i, j+p, k) / (2 * dy) - vis_dy2; 
-				
-				switch (var)	
+		BuildRHS<dir, var>(dt, i, j, k, d, n, cur, temp, width, ld);
+	}
+
+	template<DirType dir, VarType var>
+	void AdiSolver3D::BuildRHS(FTYPE dt, int i, int j, int k, FTYPE *d, int n, TimeLayer3D *cur, TimeLayer3D *temp, int width, int ld)
+	{
+		FTYPE *f = &GetField<var>(cur)->elem(i, j, k);
+		const int stride = DirStride<dir>(cur);
+
+		for (int p = 1; p < n-1; p++)
+			for (int l = 0; l < width; l++)
+			{
+				int ip = (dir == X) ? i+p : i;
+				int jp = (dir == Y) ? j+p : j;
+				int kp = (dir == Z) ? k+p : k+l;
+				int id = p * ld + l;
+
+				if (var == type_T)
 				{
-				case type_U: d[p] = cur->U->elem(i, j+p, k) * 3 / dt; break;
-				case type_V: d[p] = cur->V->elem(i, j+p, k) * 3 / dt - params.v_T * temp->T->d_y(i, j+p, k); break;
-				case type_W: d[p] = cur->W->elem(i, j+p, k) * 3 / dt; break;
-				case type_T: d[p] = cur->T->elem(i, j+p, k) * 3 / dt + params.t_phi * temp->DissFuncY(i, j+p, k); break;
+					switch (dir)
+					{
+					case X: d[id] = f[p * stride + l] * 3 / dt + params.t_phi * temp->DissFuncX(ip, jp, kp); break;
+					case Y: d[id] = f[p * stride + l] * 3 / dt + params.t_phi * temp->DissFuncY(ip, jp, kp); break;
+					case Z: d[id] = f[p * stride + l] * 3 / dt + params.t_phi * temp->DissFuncZ(ip, jp, kp); break;
+					}
 				}
-				break;
-
-			case Z:
-				a[p] = - temp->W->elem(i, j, k+p) / (2 * dz) - vis_dz2; 
-				b[p] = 3 / dt  +  2 * vis_dz2; 
-				c[p] = temp->W->elem(i, j, k+p) / (2 * dz) - vis_dz2; 
-				
-				switch (var)	
+				else if ((int)var == (int)dir)
 				{
-				case type_U: d[p] = cur->U->elem(i, j, k+p) * 3 / dt; break;
-				case type_V: d[p] = cur->V->elem(i, j, k+p) * 3 / dt; break;
-				case type_W: d[p] = cur->W->elem(i, j, k+p) * 3 / dt - params.v_T * temp->T->d_z(i, j, k+p); break;
-				case type_T: d[p] = cur->T->elem(i, j, k+p) * 3 / dt + params.t_phi * temp->DissFuncZ(i, j, k+p); break;
+					// velocity component along the sweep gets the buoyancy term
+					switch (dir)
+					{
+					case X: d[id] = f[p * stride + l] * 3 / dt - params.v_T * temp->T->d_x(ip, jp, kp); break;
+					case Y: d[id] = f[p * stride + l] * 3 / dt - params.v_T * temp->T->d_y(ip, jp, kp); break;
+					case Z: d[id] = f[p * stride + l] * 3 / dt - params.v_T * temp->T->d_z(ip, jp, kp); break;
+					}
 				}
-				break;
+				else
+					d[id] = f[p * stride + l] * 3 / dt;
 			}
-		}
 	}
 
-	void AdiSolver3D::ApplyBC0(int i, int j, int k, VarType var, FTYPE &b0, FTYPE &c0, FTYPE &d0)
+	template<VarType var>
+	void AdiSolver3D::ApplyBC0(const Node &node, FTYPE &b0, FTYPE &c0, FTYPE &d0)
 	{
-		if ((var == type_T && grid->GetBC_temp(i, j, k) == BC_FREE) ||
-			(var != type_T && grid->GetBC_vel(i, j, k) == BC_FREE))
+		if ((var == type_T && node.bc_temp == BC_FREE) ||
+			(var != type_T && node.bc_vel == BC_FREE))
 		{
 			// free: f(0) = 2 * f(1) - f(2)
 			b0 = 2.0; 
@@ -818,18 +2040,19 @@ template<DirType dir>
 			c0 = 0.0; 
 			switch (var)
 			{
-			case type_U: d0 = (FTYPE)grid->GetVel(i, j, k).x; break;
-			case type_V: d0 = (FTYPE)grid->GetVel(i, j, k).y; break;
-			case type_W: d0 = (FTYPE)grid->GetVel(i, j, k).z; break;
-			case type_T: d0 = (FTYPE)grid->GetT(i, j, k); break;
+			case type_U: d0 = (FTYPE)node.v.x; break;
+			case type_V: d0 = (FTYPE)node.v.y; break;
+			case type_W: d0 = (FTYPE)node.v.z; break;
+			case type_T: d0 = (FTYPE)node.T; break;
 			}
 		}
 	}
 
-	void AdiSolver3D::ApplyBC1(int i, int j, int k, VarType var, FTYPE &a1, FTYPE &b1, FTYPE &d1)
+	template<VarType var>
+	void AdiSolver3D::ApplyBC1(const Node &node, FTYPE &a1, FTYPE &b1, FTYPE &d1)
 	{
-		if ((var == type_T && grid->GetBC_temp(i, j, k) == BC_FREE) ||
-			(var != type_T && grid->GetBC_vel(i, j, k) == BC_FREE))
+		if ((var == type_T && node.bc_temp == BC_FREE) ||
+			(var != type_T && node.bc_vel == BC_FREE))
 		{
 			// free: f(N) = 2 * f(N-1) - f(N-2)
 			a1 = -1.0; 
@@ -843,10 +2066,10 @@ template<DirType dir>
 			b1 = 1.0; 
 			switch (var)
 			{
-			case type_U: d1 = (FTYPE)grid->GetVel(i, j, k).x; break;
-			case type_V: d1 = (FTYPE)grid->GetVel(i, j, k).y; break;
-			case type_W: d1 = (FTYPE)grid->GetVel(i, j, k).z; break;
-			case type_T: d1 = (FTYPE)grid->GetT(i, j, k); break;
+			case type_U: d1 = (FTYPE)node.v.x; break;
+			case type_V: d1 = (FTYPE)node.v.y; break;
+			case type_W: d1 = (FTYPE)node.v.z; break;
+			case type_T: d1 = (FTYPE)node.T; break;
 			}
 		}
 	}	
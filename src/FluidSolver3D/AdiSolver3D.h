@@ -18,7 +18,14 @@
 
 #define PROFILE_ENABLE		1
 #define BLOCKING_SOLVER_ENABLE 1
-#define INTERNAL_MERGE_ENABLE 1
+#define INTERNAL_MERGE_ENABLE 1		// merge the non-linear layer inside the segment update instead of a separate pass
+#define FUSED_VEL_ENABLE 1		// solve U, V, W with a single matrix factorization on CPU
+#define BATCHED_SOLVER_ENABLE 1	// solve segments of similar length in lockstep on CPU
+#define SOLVER_BATCH_SIZE 8		// segments per batch, 8 floats fill an AVX register
+#define BLOCKED_SWEEP_ENABLE 1		// X/Y batches are tiles of neighbouring rows, gathered as contiguous panels
+#define SPIKE_SOLVER_ENABLE 1		// too few segments for all threads: long ones are shared by the team (partition method)
+#define SPIKE_MIN_PART 64			// fewest rows of a segment part worth a thread
+#define PERSISTENT_TEAM_ENABLE 1	// one OpenMP team runs the whole CPU time step
 #define SOLVER_VAR_NUM 4
 
 #ifdef _WIN32
@@ -55,8 +62,12 @@ namespace FluidSolver3D
 		void Init(BackendType backend, bool _csv, Grid3D* _grid, FluidParams &_params, bool _useBlocking, int _nblockZ);
 		void UpdateBoundaries();
 		void CreateSegments();
+		void UpdateGrid(double time);		// rebuilds the grid for the given time, and its segments if any node type changed
 		void TimeStep(FTYPE dt, int num_global, int num_local, bool computeError);
 		void SetOptionsGPU(bool _transposeOpt, bool _decomposeOpt);
+		void SetOptionsCPU(bool _mixedPrecision);
+		void SetTolerance(FTYPE _tolerance);
+		double EvalCFL(FTYPE dt);
 		double sum_layer(char ch);
 		void debug(bool ifdebug);
 
@@ -68,6 +79,8 @@ namespace FluidSolver3D
 		// options, optimizations
 		bool transposeOpt, decomposeOpt;
 		bool useBlocking;
+		bool mixedPrecision;	// CPU: fields stay in FTYPE, the tridiagonal recurrences run in double
+		FTYPE tolerance;		// CPU: stop the non-linear iterations once they change temp by less, 0 runs all of them
 		
 		int nblockZ; // split Z into blocks in GPU version
 		int** numSegsBlZGPU[3]; // segments per direction per GPU per blockZ
@@ -76,15 +89,37 @@ namespace FluidSolver3D
 		int numSegs[3];
 		int* numSegsGPU[3];  // segments per direction per GPU
 		Segment3D *h_listX, *h_listY, *h_listZ;				// segments in CPU mem
+		NodesBoundary3D *h_node_listX, *h_node_listY, *h_node_listZ; // nodes' bounds in CPU mem, refreshed in UpdateBoundaries
+		int *h_order[3];									// segment ids grouped into CPU batches
+		int *h_batches[3];									// first entry of each batch in h_order
+		int numBatches[3];
+		int *comuNumSegsBlZ[3];								// first segment of each Z block, CPU blocking (X, Y)
+		int *batchesBlZ[3];									// first batch of each Z block, CPU blocking (X, Y)
+		int *h_schedule[3];									// CPU work items (batches or segments) grouped by thread
+		int numSpike[3];									// long segments at the end of each list, solved by the whole team
+		int *h_threadFirst[3];								// first schedule entry of each thread, per Z block
+		double *h_threadWork[3];							// planned work of each thread in nodes, per Z block
+		int numSweeps[3];									// sweeps done with the current plan, for the work counters
 		Segment3D **d_listX, **d_listY, **d_listZ;		// segments in multiple GPU mem 
 		NodesBoundary3D **d_node_listX, **d_node_listY, **d_node_listZ; // nodes' bounds in multiple GPU mem 
 		 
 		TimeLayer3D *temp, *half;
+		TimeLayer3D *tempNext;						// non-linear layer of the next sweep, written by the fused CPU merge
 		TimeLayer3D *curT, *tempT, *nextT;			// for transpose GPU optimization
 
 		FTYPE *mpi_buf;
 
-		FTYPE *a, *b, *c, *d, *x;									// matrices in CPU mem
+		FTYPE *a, *b, *c, *d, *x;									// matrices in CPU mem, one arena per thread
+		FTYPE *a_batch, *b_batch, *c_batch, *d_batch, *x_batch;	// interleaved batch matrices, one arena per thread
+		FTYPE *spike, *spikeReduced;								// shared arenas of the partition method: part systems, interface system
+		double *c_work, *d_work;									// double recurrence arenas of the mixed precision mode
+		FTYPE *h_residual;											// max change of the non-linear layer per thread in the current sweep
+		FTYPE sweepResidual, iterResidual;							// max change of the last sweep and of the current global iteration
+		int *h_divIndex, numDivIndex;								// NODE_IN nodes the CPU divergence error visits
+		int *h_mergeIndex[3], numMergeIndex[3];						// NODE_IN nodes no segment of the direction covers, merged apart from the fused sweep
+		FTYPE *h_maxVel;											// max |U|, |V|, |W| per thread written by the X sweeps of the step
+		int numIterGlobal, numIterLocal;							// iterations done in the current time step
+		int numThreads, scratchStride;
 		FTYPE **d_c, **d_x; // same matrices in GPU mem
 		FTYPE **d_cY, **d_xY; // cache of Y for LaunchSolveSegments_XY
 
@@ -92,23 +127,67 @@ namespace FluidSolver3D
 
 		double diffError;
 
-		void BuildMatrix(FTYPE dt, int i, int j, int k, VarType var, DirType dir, FTYPE *a, FTYPE *b, FTYPE *c, FTYPE *d, int n, TimeLayer3D *cur, TimeLayer3D *temp);
-		void ApplyBC0(int i, int j, int k, VarType var, FTYPE &b0, FTYPE &c0, FTYPE &d0);
-		void ApplyBC1(int i, int j, int k, VarType var, FTYPE &a1, FTYPE &b1, FTYPE &d1);
+		template<DirType dir, VarType var>
+		void BuildMatrix(FTYPE dt, int i, int j, int k, FTYPE *a, FTYPE *b, FTYPE *c, FTYPE *d, int n, TimeLayer3D *cur, TimeLayer3D *temp, int width = 1, int ld = 1);
+		template<DirType dir, VarType var>
+		void BuildRHS(FTYPE dt, int i, int j, int k, FTYPE *d, int n, TimeLayer3D *cur, TimeLayer3D *temp, int width = 1, int ld = 1);
+		template<VarType var>
+		void ApplyBC0(const Node &node, FTYPE &b0, FTYPE &c0, FTYPE &d0);
+		template<VarType var>
+		void ApplyBC1(const Node &node, FTYPE &a1, FTYPE &b1, FTYPE &d1);
 		
 		template<DirType dir>
-		void CreateListSegments(int &numSeg, Segment3D *h_list, Segment3D **d_list, NodesBoundary3D **d_node_list, int dim1, int dim2, int dim3);
+		void CreateListSegments(int &numSeg, Segment3D *h_list, NodesBoundary3D *h_node_list, Segment3D **d_list, NodesBoundary3D **d_node_list, int dim1, int dim2, int dim3);
 		template<DirType dir>
 		int _nodeSplitListSegments(Segment3D *dest_list, NodesBoundary3D *dest_node_list, int numSeg, Segment3D *src_list, NodesBoundary3D *src_node_list, int length, int offset);
 		void _blockSplitListSegments(int* numSegs, int* comuNumSegs, int dimz, int _nblockZ, int numSeg, Segment3D *src_list);
 		
+		int SelectSpikeSegments(DirType dir, int numSeg, Segment3D *list, NodesBoundary3D *node_list);
+		void SortSegmentsBySize(int first, int last, Segment3D *list, int *order);
+		void GetWorkRange(DirType dir, int iblock, int &first, int &last);
+		void BalanceLoad(DirType dir);
+		void FlushWorkCounters(DirType dir);
+		template<DirType dir>
+		int CreateBatches(int first, int last, Segment3D *list, int *order, int *batches, int numBatch);
 		void OutputSegmentsInfo(int num, Segment3D *list, char *filename);
 
-		void SolveSegment(FTYPE dt, int id, Segment3D seg, VarType var, DirType dir, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next);
-		void UpdateSegment(FTYPE *x, Segment3D seg, VarType var, TimeLayer3D *layer);
+		// CPU sweep kernels, instantiated per direction and variable
+		template<DirType dir>
+		void SolveSegments_CPU(FTYPE dt, Segment3D *h_list, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next, TimeLayer3D *merge = NULL, int iblock = -1);
+		template<DirType dir>
+		void SolveBins_CPU(FTYPE dt, Segment3D *h_list, NodesBoundary3D *h_node_list, int *threadFirst, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next, TimeLayer3D *merge);
+		template<DirType dir>
+		void SolveSpikes_CPU(FTYPE dt, Segment3D *h_list, NodesBoundary3D *h_node_list, int first, int last, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next, TimeLayer3D *merge);
+		template<DirType dir, VarType var>
+		void SolveSpikePart(FTYPE dt, Segment3D seg, const NodesBoundary3D &bound, int part, int parts, TimeLayer3D *cur, TimeLayer3D *temp);
+		template<VarType var>
+		void SolveSpikeInterfaces(int n, int parts);
+		template<DirType dir, VarType var>
+		void UpdateSpikePart(Segment3D seg, int part, int parts, TimeLayer3D *next, TimeLayer3D *temp, TimeLayer3D *merge);
+		template<VarType var>
+		void GetSpikeArena(FTYPE *&a, FTYPE *&b, FTYPE *&c, FTYPE *&v, FTYPE *&w, FTYPE **d, FTYPE *&band, FTYPE **z);
+		template<DirType dir, VarType var>
+		void SolveSegment(FTYPE dt, Segment3D seg, const NodesBoundary3D &bound, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next, TimeLayer3D *merge);
+		template<DirType dir>
+		void SolveSegment_Vel(FTYPE dt, Segment3D seg, const NodesBoundary3D &bound, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next, TimeLayer3D *merge);
+		template<DirType dir, VarType var>
+		void SolveBatch(FTYPE dt, Segment3D *h_list, NodesBoundary3D *h_node_list, int *order, int count, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next, TimeLayer3D *merge);
+		template<DirType dir, VarType var>
+		void SolvePanel(FTYPE dt, Segment3D *h_list, NodesBoundary3D *h_node_list, int *order, int count, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next, TimeLayer3D *merge);
+		void GetWork(double *&cw, double **dw, int nrhs);
+		template<DirType dir, VarType var>
+		void UpdateSegment(FTYPE *x, Segment3D seg, TimeLayer3D *layer, TimeLayer3D *temp, TimeLayer3D *merge, int width = 1, int ld = 1);
 		
 		void SolveDirection(DirType dir, FTYPE dt, int num_local, Segment3D *h_list, Segment3D **d_list, NodesBoundary3D **d_node_list, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *next);
 		void SolveDirection_XY(FTYPE dt, int num_local, TimeLayer3D *cur, TimeLayer3D *temp, TimeLayer3D *half, TimeLayer3D *next);
+		void SolveTimeStep(FTYPE dt, int num_global, int num_local);
+		void ReduceResidual(bool firstSweep);
+		void BuildSegments();				// segment lists and the indices derived from them, CreateSegments without the profiling
+		void BuildMergeIndex(DirType dir, int numSeg, Segment3D *list);
+		void MergeUncovered(DirType dir, TimeLayer3D *temp, TimeLayer3D *next);
+
+		void TeamStartEvent();
+		void TeamStopEvent(const char *name);
 
 		void FreeMemory();
 	};
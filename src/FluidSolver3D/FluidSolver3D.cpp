@@ -23,7 +23,7 @@
 using namespace FluidSolver3D;
 using namespace Common;
 
-void parse_cmd_params(int argc, char **argv, BackendType &backend, bool &csv, bool &transpose, bool &decompose, bool &align, int &nGPU, bool &blocking, int &nBlockZ)
+void parse_cmd_params(int argc, char **argv, BackendType &backend, bool &csv, bool &transpose, bool &decompose, bool &align, int &nGPU, bool &blocking, int &nBlockZ, bool &mixed, bool &cache)
 {
 	for( int i = 4; i < argc; i++ )
 	{
@@ -47,6 +47,8 @@ void parse_cmd_params(int argc, char **argv, BackendType &backend, bool &csv, bo
 		if( !strcmp(argv[i], "transpose") ) transpose = true;
 		if( !strcmp(argv[i], "decompose") ) decompose = true;
 		if( !strcmp(argv[i], "align") ) align = true;
+		if( !strcmp(argv[i], "mixed") ) mixed = true;
+		if( !strcmp(argv[i], "cache") ) cache = true;		// 3D and NetCDF inputs only, 2D shapes are always built
 	}
 }
 
@@ -54,6 +56,14 @@ int main(int argc, char **argv)
 {
 	try
 	{
+		// FluidSolver3D convert <text 3D shape> <binary 3D shape>
+		if( argc == 4 && !strcmp(argv[1], "convert") )
+		{
+			char shapePath[MAX_STR_SIZE];
+			FindFile(shapePath, argv[2]);
+			return Grid3D::ConvertShape(shapePath, argv[3]) ? 0 : 1;
+		}
+
 #ifdef __PARA
 		MPI_Init(&argc, &argv);
 #endif
@@ -66,7 +76,9 @@ int main(int argc, char **argv)
 		bool useBlocks = false;
 		int nBlockZ = 1;
 		int nGPU = 0;
-		parse_cmd_params(argc, argv, backend, csv, transpose, decompose, align, nGPU, useBlocks, nBlockZ);
+		bool mixed = false;
+		bool cache = false;
+		parse_cmd_params(argc, argv, backend, csv, transpose, decompose, align, nGPU, useBlocks, nBlockZ, mixed, cache);
 
 		pplan->init(backend);
 		if( backend == CPU )
@@ -108,6 +120,7 @@ int main(int argc, char **argv)
 		char configPath[MAX_STR_SIZE];
 		char outputPath[MAX_STR_SIZE];
 		char gridPath[MAX_STR_SIZE];
+		char cachePath[MAX_STR_SIZE];
 
 		FindFile(inputPath, argv[1]);
 		FindFile(configPath, argv[3]);
@@ -139,12 +152,32 @@ int main(int argc, char **argv)
 
 		grid->SetFrameTime( Config::frame_time );
 		grid->SetBoundParams( Config::bc_inV, Config::bc_inT );
+		grid->SetFrameCache( Config::frame_cache );
 
 		printf("Grid options:\n  align %s\n", align ? "ON" : "OFF");
-		if (grid->LoadFromFile(inputPath, align))
+		if (!grid->LoadFromFile(inputPath, align))
+			throw runtime_error("cannot load the input geometry");
+		if (pplan->rank() == 0)
+			printf("Grid = %i x %i x %i\n", grid->dimx, grid->dimy, grid->dimz);
+
+		// the built grid and its segments are kept next to the input for the runs with the same parameters
+		unsigned long long cacheKey = 0;
+		bool cachedGrid = false;
+		if (cache && Config::in_fmt == Shape2D)
+		{
 			if (pplan->rank() == 0)
-				printf("Grid = %i x %i x %i\n", grid->dimx, grid->dimy, grid->dimz);
-		grid->Prepare_CPU(0.0);
+				printf("Grid cache: not supported for 2D shapes\n");
+		}
+		else if (cache)
+		{
+			cacheKey = grid->GetCacheKey(inputPath, align);
+			sprintf_s(cachePath, "%s.%016llx.grid", inputPath, cacheKey);
+			cachedGrid = grid->LoadCache(cachePath, cacheKey);
+			if (pplan->rank() == 0)
+				printf("Grid cache: %s\n", cachedGrid ? "loaded" : "missing");
+		}
+		if (!cachedGrid)
+			grid->Prepare_CPU(0.0);
 		grid->Split();
 		grid->Init_GPU();
 		if (pplan->rank() == 0)
@@ -160,12 +193,7 @@ int main(int argc, char **argv)
 		}
 
 		//calculate volume:
-		double indsidePoints = 0.;
-		for (int i = 0; i < grid->dimx; i++)
-			for (int j = 0; j < grid->dimy; j++)
-				for (int k = 0; k < grid->dimz; k++)
-					if (grid->GetType(i,j,k) == NODE_IN)
-						indsidePoints += 1.0;
+		double indsidePoints = grid->GetNumNodes(NODE_IN);
 		if (pplan->rank() == 0)
 			printf("NODE_IN points = %f of total %f, volume = %f\n", indsidePoints, double(grid->dimx) * grid->dimy * grid->dimz, indsidePoints * grid->dx * grid->dy * grid->dz);
 
@@ -186,6 +214,11 @@ int main(int argc, char **argv)
 						printf("Solver options:\n  transpose %s\n  decompose %s\n  number of blocks %d\n", transpose ? "ON" : "OFF", decompose ? "ON" : "OFF", nBlockZ);
 					dynamic_cast<AdiSolver3D*>(solver)->SetOptionsGPU(transpose, decompose);
 				}
+				else
+				{
+					dynamic_cast<AdiSolver3D*>(solver)->SetOptionsCPU(mixed);
+					dynamic_cast<AdiSolver3D*>(solver)->SetTolerance((FTYPE)Config::residual_tol);
+				}
 				break;
 		}
 		solver->Init(backend, csv, grid, *params, useBlocks, nBlockZ);
@@ -196,6 +229,7 @@ int main(int argc, char **argv)
 		double length = grid->GetCycleLength();
 		double dt = length / (frames * Config::time_steps);
 		double finaltime = length * Config::cycles;
+		NetCDFWriter3D output;
 		if (pplan->rank() == 0)
 		{
 			// create file and output header
@@ -203,7 +237,7 @@ int main(int argc, char **argv)
 			sprintf_s(outputPath, MAX_STR_SIZE, "%s_res.nc", argv[2]);
 			if( Config::in_fmt == Shape2D ) bbox = new BBox3D( grid->GetGrid2D()->bbox, (float)Config::depth );
 				else bbox = &grid->GetBBox();
-			OutputNetCDF3D_header(outputPath, bbox, grid->GetDepthInfo(), dt * Config::out_time_steps, finaltime, Config::outdimx, Config::outdimy, Config::outdimz, Config::out_vars, Config::in_fmt == SeaNetCDF );
+			output.Create(outputPath, bbox, grid->GetDepthInfo(), dt * Config::out_time_steps, finaltime, Config::outdimx, Config::outdimy, Config::outdimz, Config::out_vars, Config::in_fmt == SeaNetCDF, Config::out_deflate );
 			fflush(stdout);
 		}
 
@@ -220,47 +254,91 @@ int main(int argc, char **argv)
 		timer.start();
 		int lastframe = -1;
 		int out_layer = 0;
-		double t = dt;
+		double t = 0.0;					// simulated time, advanced only by the steps actually taken
+
+		// CFL-adaptive steps: the outputs keep the nominal cadence and every frame starts with one,
+		// so steps are cut to land on the next output time and on the frame ends
+		bool adaptive = (Config::cfl > 0) && (backend == CPU);
+		double dtNominal = dt;
+		double dtOut = dt * Config::out_time_steps;
+		double eps = 1e-3 * dt;
+		double nextOut = dt;
+
 		dynamic_cast<AdiSolver3D*>(solver)->CreateSegments();
-		grid->Prepare(0);
-		for (int i=0; t < finaltime; t+=dt, i++)
+		if (!cachedGrid)
 		{
-			int currentframe = grid->GetFrame(t);
-			float layer_time = grid->GetLayerTime(t);
+			grid->Prepare(0);
+			if (cache && Config::in_fmt != Shape2D && pplan->rank() == 0)
+				grid->SaveCache(cachePath, cacheKey);
+		}
+		// a step runs from t to tEnd = t + dt, the geometry and the outputs are taken at its end
+		for (int i=0; t + dt < finaltime; i++)
+		{
+			double tEnd = t + dt;
+			int currentframe = grid->GetFrame(tEnd);
+			float layer_time = grid->GetLayerTime(tEnd);
 
 			if (currentframe != lastframe)
 			{
 				lastframe = currentframe;
 				i = 0;
+				nextOut = tEnd;
 			}
 
-			//grid->Prepare(t);
+			// moving geometry: only the rows whose node types changed get new segments
+			if (Config::grid_time_steps > 0 && (i % Config::grid_time_steps) == 0)
+			{
+				dynamic_cast<AdiSolver3D*>(solver)->UpdateGrid(tEnd);
+			}
 
 			/*if (i == 0)
 				solver->debug(true);*/			
 			solver->UpdateBoundaries(); // needs this since cur gets overwritten (do not call CreateSegments, so it is quite cheap)
-			solver->TimeStep((FTYPE)dt, Config::num_global, Config::num_local, (i%10 == 0) || (t + dt >= finaltime));			
+			solver->TimeStep((FTYPE)dt, Config::num_global, Config::num_local, (i % Config::err_time_steps == 0) || (tEnd + dt >= finaltime));			
 			// solver->SetGridBoundaries();
 			//if (i == 0)
 			//	solver->debug(false);
 
 			timer.stop();
 
+			// the solution is now at tEnd, the next step starts there
+			double dtTaken = dt;
+			t = tEnd;
+
 			PrintTimeStepInfo(currentframe, i, t, finaltime, timer.elapsed_sec());
 
-			if ((i % Config::out_time_steps) == 0)
+			if (adaptive ? (t >= nextOut - eps) : ((i % Config::out_time_steps) == 0))
 			{
-				float dur = (float)dt * Config::out_time_steps;
+				nextOut += dtOut;
+				float dur = (float)dtTaken * Config::out_time_steps;
 				if (dur > layer_time) dur = layer_time;
 				solver->GetLayer(resVel, resT, Config::outdimx, Config::outdimy, Config::outdimz);
 				if (pplan->rank() == 0)
 				{
-					OutputNetCDF3D_layer(outputPath, resVel, resT, out_layer, Config::outdimx, Config::outdimy, Config::outdimz, Config::out_vars);
+					output.WriteLayer(resVel, resT, out_layer);
 				}
 				out_layer++;
 			}
+
+			if (adaptive)
+			{
+				// aim at the target Courant number, change dt by 2x at most per step
+				double cfl = dynamic_cast<AdiSolver3D*>(solver)->EvalCFL((FTYPE)dtTaken);
+				double scale = (cfl > 0) ? Config::cfl / cfl : 2.0;
+				dt *= min(2.0, max(0.5, scale));
+				dt = min(dtNominal * Config::cfl_dt_max, max(dtNominal * Config::cfl_dt_min, dt));
+
+				// split the way to the next output, frame end or the final time into equal steps, so none
+				// of them is tiny; the frame end is looked up past t, t may already sit on the previous one;
+				// 3D shapes and sea depths run the whole cycle as one frame, so their frame end is the cycle end
+				double toFrameEnd = (Config::in_fmt == Shape2D) ? grid->GetLayerTime(t + eps) : length - fmod(t + eps, length);
+				double toEvent = min(min(nextOut - t, toFrameEnd + eps), finaltime - t);
+				if (toEvent > eps)
+					dt = toEvent / ceil(toEvent / dt - 1e-6);
+			}
 		}
 		timer.stop();
+		output.Close();
 
 		delete solver;
 		delete [] resVel;
@@ -20,23 +20,77 @@
 #include <cmath> //for abs functions
 #endif
 
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 namespace FluidSolver3D
 {
+	static inline int GetMaxThreads()
+	{
+#ifdef _OPENMP
+		return omp_get_max_threads();
+#else
+		return 1;
+#endif
+	}
+
+	// widens the X range [reach[0], reach[1]] a rasterizer would write to
+	static inline void ExtendReach(int *reach, int x)
+	{
+		reach[0] = min(reach[0], x);
+		reach[1] = max(reach[1], x);
+	}
+
 	Grid3D::Grid3D(double _dx, double _dy, double _dz, double _depth, double _depth_var, double _baseT, BackendType _backend, bool useNetCDF, SplitType _split_type) : 
-		dx(_dx), dy(_dy), dz(_dz), depth(_depth), depth_var(_depth_var), baseT(_baseT), nodes(NULL), d_types(NULL), d_typesT(NULL), backend(_backend), use3Dshape(false), frames(NULL), depthInfo(NULL), split_type(_split_type)
+		dx(_dx), dy(_dy), dz(_dz), depth(_depth), depth_var(_depth_var), baseT(_baseT), nodes(NULL), types(NULL), numBoundNodes(0), boundIndices(NULL), boundNodes(NULL), numWetBricks(0), wetBricks(NULL), rowSpans(NULL), spans(NULL), frameCacheSize(0), d_types(NULL), d_typesT(NULL), backend(_backend), use3Dshape(false), frames(NULL), depthInfo(NULL), split_type(_split_type)
 	{
 		grid2D = new FluidSolver2D::Grid2D(dx, dy, baseT, true, 0.0);
+		InitSegCache();
 	}
 
 	Grid3D::Grid3D(double _dx, double _dy, double _dz, double _baseT, BackendType _backend, bool _useNetCDF, SplitType _split_type) : 
-		dx(_dx), dy(_dy), dz(_dz), baseT(_baseT), nodes(NULL), d_types(NULL), d_typesT(NULL), backend(_backend), use3Dshape(true), useNetCDF(_useNetCDF), frames(NULL), depthInfo(NULL), split_type(_split_type)
+		dx(_dx), dy(_dy), dz(_dz), baseT(_baseT), nodes(NULL), types(NULL), numBoundNodes(0), boundIndices(NULL), boundNodes(NULL), numWetBricks(0), wetBricks(NULL), rowSpans(NULL), spans(NULL), frameCacheSize(0), d_types(NULL), d_typesT(NULL), backend(_backend), use3Dshape(true), useNetCDF(_useNetCDF), frames(NULL), depthInfo(NULL), split_type(_split_type)
 	{
 		grid2D = NULL;
+		InitSegCache();
+	}
+
+	void Grid3D::InitSegCache()
+	{
+		for (int dir = X; dir <= Z; dir++)
+		{
+			dirtyRows[dir] = NULL;
+			segCache[dir] = NULL;
+			segCacheFirst[dir] = NULL;
+			segCacheCount[dir] = NULL;
+		}
 	}
 
 	Grid3D::~Grid3D()
 	{
 		if (nodes != NULL) delete [] nodes;
+		if (types != NULL) delete [] types;
+		if (boundIndices != NULL) delete [] boundIndices;
+		if (boundNodes != NULL) delete [] boundNodes;
+		if (wetBricks != NULL) delete [] wetBricks;
+		for (int dir = X; dir <= Z; dir++)
+		{
+			if (dirtyRows[dir] != NULL) delete [] dirtyRows[dir];
+			if (segCache[dir] != NULL) delete [] segCache[dir];
+			if (segCacheFirst[dir] != NULL) delete [] segCacheFirst[dir];
+			if (segCacheCount[dir] != NULL) delete [] segCacheCount[dir];
+		}
+		for (map<pair<int, int>, CachedFrame3D>::iterator it = frameCache.begin(); it != frameCache.end(); it++)
+		{
+			delete [] it->second.types;
+			delete [] it->second.boundIndices;
+			delete [] it->second.boundNodes;
+		}
+		if (rowSpans != NULL) delete [] rowSpans;
+		if (spans != NULL) delete [] spans;
 		if (d_typesT != NULL) multiDevFree<NodeType>(d_typesT);
 		if (d_types != NULL) multiDevFree<NodeType>(d_types);
 		if (grid2D != NULL) delete grid2D;
@@ -48,6 +102,11 @@ namespace FluidSolver3D
 	{
 		bool warned = false;		// warning about num of segs per row
 		numSeg = 0;
+		if (segCacheFirst[dir] == NULL)
+		{
+			segCacheFirst[dir] = new int[dim2 * dim3];
+			segCacheCount[dir] = new int[dim2 * dim3];
+		}
 		int _nblockZ = 1;
 		switch (dir)
 		{
@@ -64,58 +123,20 @@ namespace FluidSolver3D
 			for (int i = 0; i < dim2; i++)
 				for (int j = block_start; j < block_end; j++)
 				{
-					Segment3D seg, new_seg;
-					int state = 0, incx, incy, incz;
-					switch (dir)
-					{
-					case X:	
-						seg.posx = 0; seg.posy = i; seg.posz = j; 
-						incx = 1; incy = 0; incz = 0;
-						break;
-					case Y: 
-						seg.posx = i; seg.posy = 0; seg.posz = j; 
-						incx = 0; incy = 1; incz = 0;
-						break;
-					case Z: 
-						seg.posx = i; seg.posy = j; seg.posz = 0; 
-						incx = 0; incy = 0; incz = 1; 
-						break;
-					}
-					seg.dir = (DirType)dir;
-					
-					int num_segs_per_row = 0;
-					while ((seg.posx + incx < dimx) && (seg.posy + incy < dimy) && (seg.posz + incz < dimz))
+					// rows whose types did not change since the previous list keep their segments
+					int row = i * dim3 + j;
+					int num_segs_per_row;
+					if (segCache[dir] != NULL && dirtyRows[dir] != NULL && !dirtyRows[dir][row])
 					{
-						if (GetType(seg.posx + incx, seg.posy + incy, seg.posz + incz) == NODE_IN)
-						{
-							if (state == 0) 
-								new_seg = seg;
-							state = 1;
-						}
-						else
-						{
-							if (state == 1)
-							{
-								new_seg.endx = seg.posx + incx;
-								new_seg.endy = seg.posy + incy;
-								new_seg.endz = seg.posz + incz;
-
-								new_seg.size = (new_seg.endx - new_seg.posx) + (new_seg.endy - new_seg.posy) + (new_seg.endz - new_seg.posz) + 1;
-
-								new_seg.skipX = false;
-								new_seg.type = BOUND;
-								h_list[numSeg] = new_seg;
-								numSeg++;
-								num_segs_per_row++;
-								state = 0;
-							}
-						}
-					
-						seg.posx += incx;
-						seg.posy += incy;
-						seg.posz += incz;
+						num_segs_per_row = segCacheCount[dir][row];
+						memcpy(h_list + numSeg, segCache[dir] + segCacheFirst[dir][row], sizeof(Segment3D) * num_segs_per_row);
 					}
-					
+					else
+						num_segs_per_row = GenerateRowSegments(h_list + numSeg, i, j, dir);
+					segCacheFirst[dir][row] = numSeg;
+					segCacheCount[dir][row] = num_segs_per_row;
+					numSeg += num_segs_per_row;
+
 					if( num_segs_per_row > MAX_SEGS_PER_ROW && !warned ) {
 						printf("WARNING: num of segs per row (%i) > max allowed (%i)\n", num_segs_per_row, MAX_SEGS_PER_ROW );
 						warned = true;
@@ -124,14 +145,74 @@ namespace FluidSolver3D
 				block_start = block_end;
 				block_end += (block_end + dim3 / _nblockZ == (dim3 / _nblockZ)* _nblockZ)? dim3 / _nblockZ + dim3 % _nblockZ: dim3 / _nblockZ;
 		}
+
+		if (segCache[dir] != NULL) delete [] segCache[dir];
+		segCache[dir] = new Segment3D[numSeg];
+		memcpy(segCache[dir], h_list, sizeof(Segment3D) * numSeg);
+		if (dirtyRows[dir] != NULL) memset(dirtyRows[dir], 0, dim2 * dim3);
+	}
+
+	int Grid3D::GenerateRowSegments(Segment3D *h_list, int i, int j, DirType dir)
+	{
+		Segment3D seg, new_seg;
+		int state = 0, incx, incy, incz;
+		switch (dir)
+		{
+		case X:	
+			seg.posx = 0; seg.posy = i; seg.posz = j; 
+			incx = 1; incy = 0; incz = 0;
+			break;
+		case Y: 
+			seg.posx = i; seg.posy = 0; seg.posz = j; 
+			incx = 0; incy = 1; incz = 0;
+			break;
+		case Z: 
+			seg.posx = i; seg.posy = j; seg.posz = 0; 
+			incx = 0; incy = 0; incz = 1; 
+			break;
+		}
+		seg.dir = (DirType)dir;
+		
+		int numSeg = 0;
+		while ((seg.posx + incx < dimx) && (seg.posy + incy < dimy) && (seg.posz + incz < dimz))
+		{
+			if (GetType(seg.posx + incx, seg.posy + incy, seg.posz + incz) == NODE_IN)
+			{
+				if (state == 0) 
+					new_seg = seg;
+				state = 1;
+			}
+			else
+			{
+				if (state == 1)
+				{
+					new_seg.endx = seg.posx + incx;
+					new_seg.endy = seg.posy + incy;
+					new_seg.endz = seg.posz + incz;
+
+					new_seg.size = (new_seg.endx - new_seg.posx) + (new_seg.endy - new_seg.posy) + (new_seg.endz - new_seg.posz) + 1;
+
+					new_seg.skipX = false;
+					new_seg.type = BOUND;
+					h_list[numSeg] = new_seg;
+					numSeg++;
+					state = 0;
+				}
+			}
+		
+			seg.posx += incx;
+			seg.posy += incy;
+			seg.posz += incz;
+		}
+		return numSeg;
 	}
 
 	void Grid3D::GenerateGridBoundaries(NodesBoundary3D *node_list, int numSeg, Segment3D *h_list, bool transposed)
 	{
 			for (int iseg = 0; iseg < numSeg; iseg++)
 			{
-				node_list[iseg].first = nodes[ h_list[iseg].posx * dimy * dimz + h_list[iseg].posy * dimz + h_list[iseg].posz ];
-				node_list[iseg].last = nodes[ h_list[iseg].endx * dimy * dimz + h_list[iseg].endy * dimz + h_list[iseg].endz ];
+				node_list[iseg].first = GetNode( h_list[iseg].posx * dimy * dimz + h_list[iseg].posy * dimz + h_list[iseg].posz );
+				node_list[iseg].last = GetNode( h_list[iseg].endx * dimy * dimz + h_list[iseg].endy * dimz + h_list[iseg].endz );
 				//if (transposed)
 				//{
 				//	node_list[iseg].first = nodes[ h_list[iseg].posx * dimy * dimz + h_list[iseg].posy * dimz + h_list[iseg].posz ];
@@ -241,7 +322,79 @@ namespace FluidSolver3D
 
 	NodeType Grid3D::GetType(int i, int j, int k)
 	{
-		return nodes[i * dimy * dimz + j * dimz + k].type;
+		int index = i * dimy * dimz + j * dimz + k;
+		return (nodes != NULL) ? nodes[index].type : (NodeType)types[index];
+	}
+
+	int Grid3D::FindBoundNode(int index)
+	{
+		// boundary records are sorted by index
+		int lo = 0, hi = numBoundNodes;
+		while (lo < hi)
+		{
+			int mid = (lo + hi) / 2;
+			if (boundIndices[mid] < index) lo = mid + 1; else hi = mid;
+		}
+		return (lo < numBoundNodes && boundIndices[lo] == index) ? lo : -1;
+	}
+
+	Node Grid3D::GetNode(int index)
+	{
+		if (nodes != NULL) return nodes[index];
+
+		int b = FindBoundNode(index);
+		if (b >= 0) return boundNodes[b];
+
+		Node node;
+		node.type = (NodeType)types[index];
+		node.bc_vel = BC_NOSLIP;
+		node.bc_temp = BC_NOSLIP;
+		node.v = Vec3D(0.0, 0.0, 0.0);
+		node.T = (FTYPE)baseT;
+		return node;
+	}
+
+	int Grid3D::GetNumWetBricks()
+	{
+		return numWetBricks;
+	}
+
+	void Grid3D::GetBrickRange(int n, int &i0, int &i1, int &j0, int &j1, int &k0, int &k1)
+	{
+		int id = wetBricks[n];
+		i0 = (id / (bricksy * bricksz)) * BRICK_SIZE;
+		j0 = ((id / bricksz) % bricksy) * BRICK_SIZE;
+		k0 = (id % bricksz) * BRICK_SIZE;
+		i1 = min(i0 + BRICK_SIZE, dimx);
+		j1 = min(j0 + BRICK_SIZE, dimy);
+		k1 = min(k0 + BRICK_SIZE, dimz);
+	}
+
+	long long Grid3D::GetWetPageBytes(int elemSize)
+	{
+		// the layout is i-major, so a page holds whole Z runs of several (i, j) rows
+		long long numPages = ((long long)dimx * dimy * dimz * elemSize + PAGE_BYTES - 1) / PAGE_BYTES;
+		char *touched = new char[numPages];
+		memset(touched, 0, numPages);
+		for (int n = 0; n < numWetBricks; n++)
+		{
+			int i0, i1, j0, j1, k0, k1;
+			GetBrickRange(n, i0, i1, j0, j1, k0, k1);
+			for (int i = i0; i < i1; i++)
+				for (int j = j0; j < j1; j++)
+				{
+					long long first = ((long long)i * dimy * dimz + j * dimz + k0) * elemSize;
+					long long last = ((long long)i * dimy * dimz + j * dimz + k1) * elemSize - 1;
+					for (long long p = first / PAGE_BYTES; p <= last / PAGE_BYTES; p++)
+						touched[p] = 1;
+				}
+		}
+
+		long long num = 0;
+		for (long long p = 0; p < numPages; p++)
+			if (touched[p]) num++;
+		delete [] touched;
+		return num * PAGE_BYTES;
 	}
 
 	NodeType **Grid3D::GetTypesGPU(bool transposed)
@@ -249,29 +402,60 @@ namespace FluidSolver3D
 		return (transposed ? d_typesT : d_types);
 	}
 
-	Node *Grid3D::GetNodesCPU()
+	const NodeSpan *Grid3D::GetRowSpans(int i, int j, int &num)
+	{
+		int row = i * dimy + j;
+		num = rowSpans[row + 1] - rowSpans[row];
+		return spans + rowSpans[row];
+	}
+
+	const unsigned char *Grid3D::GetTypesCPU()
+	{
+		return types;
+	}
+
+	int Grid3D::GetNumNodes(NodeType type)
 	{
-		return nodes;
+		int size = dimx * dimy * dimz;
+		int num = 0;
+		for (int i = 0; i < size; i++)
+			if (types[i] == type) num++;
+		return num;
+	}
+
+	int Grid3D::GetNumBoundNodes()
+	{
+		return numBoundNodes;
+	}
+
+	const int *Grid3D::GetBoundIndices()
+	{
+		return boundIndices;
+	}
+
+	const Node *Grid3D::GetBoundNodes()
+	{
+		return boundNodes;
 	}
 
 	BCtype Grid3D::GetBC_vel(int i, int j, int k)
 	{
-		return nodes[i * dimy * dimz + j * dimz + k].bc_vel;
+		return GetNode(i * dimy * dimz + j * dimz + k).bc_vel;
 	}
 
 	BCtype Grid3D::GetBC_temp(int i, int j, int k)
 	{
-		return nodes[i * dimy * dimz + j * dimz + k].bc_temp;
+		return GetNode(i * dimy * dimz + j * dimz + k).bc_temp;
 	}
 
 	Vec3D Grid3D::GetVel(int i, int j, int k)
 	{
-		return nodes[i * dimy * dimz + j * dimz + k].v;
+		return GetNode(i * dimy * dimz + j * dimz + k).v;
 	}
 
 	FTYPE Grid3D::GetT(int i, int j, int k)
 	{
-		return nodes[i * dimy * dimz + j * dimz + k].T;
+		return GetNode(i * dimy * dimz + j * dimz + k).T;
 	}
 
 	void Grid3D::SetType(int i, int j, int k, NodeType _type)
@@ -347,7 +531,16 @@ namespace FluidSolver3D
 
 	void Grid3D::SetNodeVel(int i, int j, int k, Vec3D new_v)
 	{
-		nodes[i * dimy * dimz + j * dimz + k].v = new_v;
+		int index = i * dimy * dimz + j * dimz + k;
+		if (nodes != NULL)
+		{
+			nodes[index].v = new_v;
+			return;
+		}
+
+		// between the builds only the boundary nodes keep a velocity
+		int b = FindBoundNode(index);
+		if (b >= 0) boundNodes[b].v = new_v;
 	}
 
 	void Grid3D::Init(bool align)
@@ -370,22 +563,22 @@ namespace FluidSolver3D
 		}
 	}
 
-	bool Grid3D::Load3DShape(char *filename, bool align)
+	FrameInfo3D *Grid3D::ReadShapeText(char *filename, int &num)
 	{
 		// load 3D poly model
 		FILE *file = NULL;
 		if (fopen_s(&file, filename, "r") != 0)
 		{
 			printf("Error: cannot open file \"%s\" \n", filename);
-			return false;
+			return NULL;
 		}
 
-		fscanf_s(file, "%i", &num_frames);	
+		fscanf_s(file, "%i", &num);	
 		Vec3D p;
 		int temp;
-		frames = new FrameInfo3D[num_frames];
+		FrameInfo3D *frames = new FrameInfo3D[num];
 	
-		for (int j=0; j<num_frames; j++)
+		for (int j=0; j<num; j++)
 		{
 			// use only 1 shape for now
 			frames[j].Init(1);
@@ -397,7 +590,7 @@ namespace FluidSolver3D
 				for (int k=0; k<frames[j].Shapes[i].NumVertices; k++)
 				{
 					ReadPoint3D(file, p);
-					frames[j].Shapes[i].Vertices[k] = p * GRID_SCALE_FACTOR;
+					frames[j].Shapes[i].Vertices[k] = p;
 					
 					ReadPoint3D(file, p);
 					frames[j].Shapes[i].Velocities[k] = p;
@@ -417,6 +610,254 @@ namespace FluidSolver3D
 		}
 		fclose(file);
 
+		return frames;
+	}
+
+	// binary 3D shape, the text format laid out as little-endian blocks:
+	//   header:	char magic[8], int version, int num_frames, int reserved[2]
+	//   frame:		int NumVertices, int NumIndices, int reserved[2],
+	//				float vertices[NumVertices][3], float velocities[NumVertices][3], int indices[NumIndices][3]
+	// every block is padded to MESH_ALIGN bytes, so a mapped file can be addressed in place
+	struct MeshHeader3D
+	{
+		char magic[8];
+		int version;
+		int num;
+		int reserved[2];
+	};
+
+	struct MeshFrame3D
+	{
+		int numVertices;
+		int numIndices;
+		int reserved[2];
+	};
+
+	// size of a block in the file, with its padding
+	static long long MeshBlockSize(long long size)
+	{
+		return (size + MESH_ALIGN - 1) / MESH_ALIGN * MESH_ALIGN;
+	}
+
+	static bool ReadMeshBlock(FILE *file, void *data, size_t size)
+	{
+		char pad[MESH_ALIGN];
+		size_t padding = (MESH_ALIGN - size % MESH_ALIGN) % MESH_ALIGN;
+		return fread(data, 1, size, file) == size && fread(pad, 1, padding, file) == padding;
+	}
+
+	static bool WriteMeshBlock(FILE *file, const void *data, size_t size)
+	{
+		char pad[MESH_ALIGN] = { 0 };
+		size_t padding = (MESH_ALIGN - size % MESH_ALIGN) % MESH_ALIGN;
+		return fwrite(data, 1, size, file) == size && fwrite(pad, 1, padding, file) == padding;
+	}
+
+	// points are stored as float triples, read straight into Vec3D unless FTYPE is wider
+	static bool ReadMeshPoints(FILE *file, Vec3D *p, int num)
+	{
+		if (sizeof(Vec3D) == 3 * sizeof(float))
+			return ReadMeshBlock(file, p, num * sizeof(Vec3D));
+
+		float *buf = new float[num * 3];
+		bool ok = ReadMeshBlock(file, buf, num * 3 * sizeof(float));
+		for (int k = 0; k < num; k++)
+			p[k] = Vec3D(buf[k*3], buf[k*3+1], buf[k*3+2]);
+		delete [] buf;
+		return ok;
+	}
+
+	static bool WriteMeshPoints(FILE *file, const Vec3D *p, int num)
+	{
+		if (sizeof(Vec3D) == 3 * sizeof(float))
+			return WriteMeshBlock(file, p, num * sizeof(Vec3D));
+
+		float *buf = new float[num * 3];
+		for (int k = 0; k < num; k++)
+		{
+			buf[k*3] = (float)p[k].x;
+			buf[k*3+1] = (float)p[k].y;
+			buf[k*3+2] = (float)p[k].z;
+		}
+		bool ok = WriteMeshBlock(file, buf, num * 3 * sizeof(float));
+		delete [] buf;
+		return ok;
+	}
+
+	bool Grid3D::IsMeshFile(char *filename)
+	{
+		FILE *file = NULL;
+		if (fopen_s(&file, filename, "rb") != 0)
+			return false;
+
+		char magic[8];
+		bool res = fread(magic, 1, 8, file) == 8 && !memcmp(magic, MESH_MAGIC, 8);
+		fclose(file);
+		return res;
+	}
+
+	FrameInfo3D *Grid3D::ReadShapeMesh(char *filename, int &num)
+	{
+		FILE *file = NULL;
+		if (fopen_s(&file, filename, "rb") != 0)
+		{
+			printf("Error: cannot open file \"%s\" \n", filename);
+			return NULL;
+		}
+
+		MeshHeader3D header;
+		if (!ReadMeshBlock(file, &header, sizeof(header)) || memcmp(header.magic, MESH_MAGIC, 8) || header.version != MESH_VERSION)
+		{
+			printf("Error: unsupported mesh file \"%s\" \n", filename);
+			fclose(file);
+			return NULL;
+		}
+
+		// the counts are checked against the bytes left before anything is allocated
+		long pos = ftell(file);
+		fseek(file, 0, SEEK_END);
+		long long size = ftell(file);
+		fseek(file, pos, SEEK_SET);
+
+		if (header.num <= 0 || header.num > (size - pos) / MeshBlockSize(sizeof(MeshFrame3D)))
+		{
+			printf("Error: mesh file \"%s\" has a bad number of frames (%i) \n", filename, header.num);
+			fclose(file);
+			return NULL;
+		}
+
+		num = header.num;
+		FrameInfo3D *frames = new FrameInfo3D[num];
+		const char *error = NULL;
+
+		for (int j = 0; error == NULL && j < num; j++)
+		{
+			// use only 1 shape for now
+			frames[j].Init(1);
+
+			for (int i = 0; error == NULL && i < frames[j].NumShapes; i++)
+			{
+				Shape3D &shape = frames[j].Shapes[i];
+
+				MeshFrame3D info;
+				if (!ReadMeshBlock(file, &info, sizeof(info)))
+				{
+					error = "is truncated";
+					break;
+				}
+				if (info.numVertices < 0 || info.numIndices < 0)
+				{
+					error = "has negative vertex or index counts";
+					break;
+				}
+				long long need = 2 * MeshBlockSize(3LL * sizeof(float) * info.numVertices) + MeshBlockSize(3LL * sizeof(int) * info.numIndices);
+				if (need > size - ftell(file))
+				{
+					error = "is truncated";
+					break;
+				}
+
+				shape.InitVerts(info.numVertices);
+				shape.InitInds(info.numIndices);
+				if (!ReadMeshPoints(file, shape.Vertices, shape.NumVertices) ||
+					!ReadMeshPoints(file, shape.Velocities, shape.NumVertices) ||
+					!ReadMeshBlock(file, shape.Indices, shape.NumIndices * 3 * sizeof(int)))
+				{
+					error = "is truncated";
+					break;
+				}
+				for (int k = 0; k < shape.NumIndices * 3; k++)
+					if (shape.Indices[k] < 0 || shape.Indices[k] >= shape.NumVertices)
+					{
+						error = "has vertex indices out of range";
+						break;
+					}
+
+				shape.Active = false;
+				frames[j].Duration = 1.0 / 75;			// 75 fps
+			}
+		}
+		fclose(file);
+
+		if (error != NULL)
+		{
+			printf("Error: mesh file \"%s\" %s \n", filename, error);
+			delete [] frames;
+			return NULL;
+		}
+
+		return frames;
+	}
+
+	bool Grid3D::WriteShapeMesh(char *filename, FrameInfo3D *frames, int num)
+	{
+		FILE *file = NULL;
+		if (fopen_s(&file, filename, "wb") != 0)
+		{
+			printf("Error: cannot open file \"%s\" \n", filename);
+			return false;
+		}
+
+		MeshHeader3D header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, MESH_MAGIC, 8);
+		header.version = MESH_VERSION;
+		header.num = num;
+		bool ok = WriteMeshBlock(file, &header, sizeof(header));
+
+		for (int j = 0; ok && j < num; j++)
+			for (int i = 0; ok && i < frames[j].NumShapes; i++)
+			{
+				Shape3D &shape = frames[j].Shapes[i];
+
+				MeshFrame3D info;
+				memset(&info, 0, sizeof(info));
+				info.numVertices = shape.NumVertices;
+				info.numIndices = shape.NumIndices;
+
+				ok = WriteMeshBlock(file, &info, sizeof(info)) &&
+					 WriteMeshPoints(file, shape.Vertices, shape.NumVertices) &&
+					 WriteMeshPoints(file, shape.Velocities, shape.NumVertices) &&
+					 WriteMeshBlock(file, shape.Indices, shape.NumIndices * 3 * sizeof(int));
+			}
+		fclose(file);
+
+		if (!ok)
+			printf("Error: cannot write file \"%s\" \n", filename);
+		return ok;
+	}
+
+	bool Grid3D::ConvertShape(char *textFile, char *meshFile)
+	{
+		int num;
+		FrameInfo3D *frames = ReadShapeText(textFile, num);
+		if (frames == NULL)
+			return false;
+
+		bool res = WriteShapeMesh(meshFile, frames, num);
+		delete [] frames;
+		return res;
+	}
+
+	bool Grid3D::Load3DShape(char *filename, bool align)
+	{
+		frames = ReadShapeText(filename, num_frames);
+		return (frames != NULL) && InitShape(align);
+	}
+
+	bool Grid3D::LoadMesh3D(char *filename, bool align)
+	{
+		frames = ReadShapeMesh(filename, num_frames);
+		return (frames != NULL) && InitShape(align);
+	}
+
+	bool Grid3D::InitShape(bool align)
+	{
+		for (int j = 0; j < num_frames; j++)
+			for (int i = 0; i < frames[j].NumShapes; i++)
+				for (int k = 0; k < frames[j].Shapes[i].NumVertices; k++)
+					frames[j].Shapes[i].Vertices[k] = frames[j].Shapes[i].Vertices[k] * GRID_SCALE_FACTOR;
+
 		bbox.Build(num_frames, frames);
 		
 		Init(align);
@@ -434,6 +875,224 @@ namespace FluidSolver3D
 		return true;
 	}
 
+	// startup cache, blocks are laid out as in the binary shape files:
+	//   header, types[dimx * dimy * dimz], boundIndices, boundNodes,
+	//   then per direction dirtyRows, segCacheFirst, segCacheCount of every row and segCache;
+	// nodes and segments are stored as they are in memory, the key covers their sizes
+	struct GridCacheHeader3D
+	{
+		char magic[8];
+		int version;
+		int dimx, dimy, dimz;
+		unsigned long long key;
+		int numBoundNodes;
+		int numSegs[3];
+	};
+
+	// FNV-1a
+	static unsigned long long HashBytes(const void *data, size_t size, unsigned long long h)
+	{
+		const unsigned char *p = (const unsigned char*)data;
+		for (size_t i = 0; i < size; i++)
+		{
+			h ^= p[i];
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+	unsigned long long Grid3D::GetCacheKey(char *filename, bool align)
+	{
+		unsigned long long h = 14695981039346656037ULL;
+
+		FILE *file = NULL;
+		if (fopen_s(&file, filename, "rb") == 0)
+		{
+			char buf[65536];
+			size_t n;
+			while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+				h = HashBytes(buf, n, h);
+			fclose(file);
+		}
+
+		int format[] = { GRID_CACHE_VERSION, align, useNetCDF, split_type, (int)sizeof(FTYPE), (int)sizeof(Node), (int)sizeof(Segment3D) };
+		double params[] = { dx, dy, dz, baseT, bcInVel.x, bcInVel.y, bcInVel.z, bcInT, frame_time };
+		h = HashBytes(format, sizeof(format), h);
+		h = HashBytes(params, sizeof(params), h);
+		if (!use3Dshape)
+		{
+			// extruded 2D shapes are not cached yet (LoadCache rejects them), the depth is keyed for when they are
+			double extrude[] = { depth, depth_var };
+			h = HashBytes(extrude, sizeof(extrude), h);
+		}
+		return h;
+	}
+
+	bool Grid3D::LoadCache(char *filename, unsigned long long key)
+	{
+		if (!use3Dshape) return false;
+
+		FILE *file = NULL;
+		if (fopen_s(&file, filename, "rb") != 0)
+			return false;
+
+		GridCacheHeader3D header;
+		if (!ReadMeshBlock(file, &header, sizeof(header)) || memcmp(header.magic, GRID_CACHE_MAGIC, 8) || header.version != GRID_CACHE_VERSION ||
+			header.key != key || header.dimx != dimx || header.dimy != dimy || header.dimz != dimz)
+		{
+			fclose(file);
+			return false;
+		}
+
+		int size = dimx * dimy * dimz;
+		int rows[3] = { dimy * dimz, dimx * dimz, dimx * dimy };
+
+		// the counts are checked against the bytes left before anything is allocated
+		long pos = ftell(file);
+		fseek(file, 0, SEEK_END);
+		long long left = ftell(file) - (long long)pos;
+		fseek(file, pos, SEEK_SET);
+
+		long long need = MeshBlockSize(size);
+		bool counts = header.numBoundNodes >= 0 && header.numBoundNodes <= size;
+		need += MeshBlockSize(sizeof(int) * (long long)header.numBoundNodes) + MeshBlockSize(sizeof(Node) * (long long)header.numBoundNodes);
+		for (int dir = X; dir <= Z; dir++)
+		{
+			counts = counts && header.numSegs[dir] >= 0;
+			need += MeshBlockSize(rows[dir]) + 2 * MeshBlockSize(sizeof(int) * (long long)rows[dir]) + MeshBlockSize(sizeof(Segment3D) * (long long)header.numSegs[dir]);
+		}
+		if (!counts || need > left)
+		{
+			fclose(file);
+			return false;
+		}
+
+		numBoundNodes = header.numBoundNodes;
+		types = new unsigned char[size];
+		boundIndices = new int[numBoundNodes];
+		boundNodes = new Node[numBoundNodes];
+		bool ok = ReadMeshBlock(file, types, size) &&
+				  ReadMeshBlock(file, boundIndices, sizeof(int) * numBoundNodes) &&
+				  ReadMeshBlock(file, boundNodes, sizeof(Node) * numBoundNodes);
+
+		for (int dir = X; dir <= Z; dir++)
+		{
+			dirtyRows[dir] = new unsigned char[rows[dir]];
+			segCacheFirst[dir] = new int[rows[dir]];
+			segCacheCount[dir] = new int[rows[dir]];
+			segCache[dir] = new Segment3D[header.numSegs[dir]];
+			ok = ok && ReadMeshBlock(file, dirtyRows[dir], rows[dir]) &&
+				 ReadMeshBlock(file, segCacheFirst[dir], sizeof(int) * rows[dir]) &&
+				 ReadMeshBlock(file, segCacheCount[dir], sizeof(int) * rows[dir]) &&
+				 ReadMeshBlock(file, segCache[dir], sizeof(Segment3D) * header.numSegs[dir]);
+		}
+		fclose(file);
+
+		// the indices are used without checks by the solver, so a file that points outside the grid is rejected
+		for (int i = 0; ok && i < numBoundNodes; i++)
+			ok = boundIndices[i] >= 0 && boundIndices[i] < size;
+		for (int dir = X; ok && dir <= Z; dir++)
+		{
+			for (int r = 0; ok && r < rows[dir]; r++)
+				ok = segCacheFirst[dir][r] >= 0 && segCacheCount[dir][r] >= 0 && segCacheCount[dir][r] <= MAX_SEGS_PER_ROW &&
+					 segCacheFirst[dir][r] <= header.numSegs[dir] - segCacheCount[dir][r];
+			for (int k = 0; ok && k < header.numSegs[dir]; k++)
+			{
+				const Segment3D &seg = segCache[dir][k];
+				ok = seg.dir == dir && seg.size > 0 &&
+					 seg.posx >= 0 && seg.posx <= seg.endx && seg.endx < dimx &&
+					 seg.posy >= 0 && seg.posy <= seg.endy && seg.endy < dimy &&
+					 seg.posz >= 0 && seg.posz <= seg.endz && seg.endz < dimz;
+			}
+		}
+
+		if (!ok)
+		{
+			// a damaged file leaves the grid to be built as usual
+			delete [] types; types = NULL;
+			delete [] boundIndices; boundIndices = NULL;
+			delete [] boundNodes; boundNodes = NULL;
+			numBoundNodes = 0;
+			for (int dir = X; dir <= Z; dir++)
+			{
+				delete [] dirtyRows[dir];
+				delete [] segCacheFirst[dir];
+				delete [] segCacheCount[dir];
+				delete [] segCache[dir];
+			}
+			InitSegCache();
+			return false;
+		}
+
+		// the staging nodes allocated by the loader are not needed any more
+		if (nodes != NULL) delete [] nodes;
+		nodes = NULL;
+
+		// the cached grid is the build at time 0, kept for the next cycles as Prepare_CPU would do
+		if (!useNetCDF && frameCacheSize > 0)
+		{
+			pair<int, int> frameKey;
+			double substep;
+			FindSubframe(0.0, frameKey.first, substep);
+			frameKey.second = (int)floor(substep * FRAME_CACHE_STEPS + 0.5);
+			StoreFrame(frameKey);
+		}
+
+		BuildBricks();
+		BuildSpans();
+		return true;
+	}
+
+	bool Grid3D::SaveCache(char *filename, unsigned long long key)
+	{
+		if (!use3Dshape || types == NULL) return false;
+		for (int dir = X; dir <= Z; dir++)
+			if (segCache[dir] == NULL) return false;
+
+		int size = dimx * dimy * dimz;
+		int rows[3] = { dimy * dimz, dimx * dimz, dimx * dimy };
+
+		GridCacheHeader3D header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, GRID_CACHE_MAGIC, 8);
+		header.version = GRID_CACHE_VERSION;
+		header.dimx = dimx;
+		header.dimy = dimy;
+		header.dimz = dimz;
+		header.key = key;
+		header.numBoundNodes = numBoundNodes;
+		for (int dir = X; dir <= Z; dir++)
+			for (int r = 0; r < rows[dir]; r++)
+				header.numSegs[dir] += segCacheCount[dir][r];
+
+		FILE *file = NULL;
+		if (fopen_s(&file, filename, "wb") != 0)
+		{
+			printf("Warning: cannot write grid cache \"%s\" \n", filename);
+			return false;
+		}
+
+		bool ok = WriteMeshBlock(file, &header, sizeof(header)) &&
+				  WriteMeshBlock(file, types, size) &&
+				  WriteMeshBlock(file, boundIndices, sizeof(int) * numBoundNodes) &&
+				  WriteMeshBlock(file, boundNodes, sizeof(Node) * numBoundNodes);
+
+		for (int dir = X; dir <= Z; dir++)
+			ok = ok && WriteMeshBlock(file, dirtyRows[dir], rows[dir]) &&
+				 WriteMeshBlock(file, segCacheFirst[dir], sizeof(int) * rows[dir]) &&
+				 WriteMeshBlock(file, segCacheCount[dir], sizeof(int) * rows[dir]) &&
+				 WriteMeshBlock(file, segCache[dir], sizeof(Segment3D) * header.numSegs[dir]);
+		fclose(file);
+
+		if (!ok)
+		{
+			// drop the partial file, so the next run does not pick it up
+			printf("Warning: cannot write grid cache \"%s\" \n", filename);
+			remove(filename);
+		}
+		return ok;
+	}
+
 	bool Grid3D::LoadNetCDF(char *filename, bool align)
 	{
 		int status;
@@ -491,6 +1150,8 @@ namespace FluidSolver3D
 		{
 			if (useNetCDF) 
 				return LoadNetCDF(filename, align);
+			else if (IsMeshFile(filename))
+				return LoadMesh3D(filename, align);
 			else 
 				return Load3DShape(filename, align);
 		}
@@ -514,6 +1175,30 @@ namespace FluidSolver3D
 
 	void Grid3D::Prepare_CPU(double time)
 	{
+		// periodic geometry: a subframe built in an earlier cycle is replayed from the cache
+		bool cached = use3Dshape && !useNetCDF && (frameCacheSize > 0);
+		pair<int, int> key;
+		if (cached)
+		{
+			double substep;
+			FindSubframe(time, key.first, substep);
+			key.second = (int)floor(substep * FRAME_CACHE_STEPS + 0.5);
+
+			map<pair<int, int>, CachedFrame3D>::iterator it = frameCache.find(key);
+			if (it != frameCache.end())
+			{
+				RestoreFrame(it->second);
+				BuildBricks();
+				BuildSpans();
+				return;
+			}
+		}
+
+		// the first build works on the nodes allocated by the loader, and its boundary records
+		// keep the loader's data, so it is never cached
+		bool firstBuild = (types == NULL);
+		if (nodes == NULL) ExpandNodes();
+
 		if (use3Dshape) 
 		{
 			if (useNetCDF) Prepare3D_NetCDF(time);
@@ -521,6 +1206,223 @@ namespace FluidSolver3D
 		}
 		else
 			Prepare2D(time);
+
+		CompactNodes();
+		if (cached && !firstBuild && (int)frameCache.size() < frameCacheSize)
+			StoreFrame(key);
+		BuildBricks();
+		BuildSpans();
+	}
+
+	void Grid3D::SetFrameCache(int maxFrames)
+	{
+		frameCacheSize = maxFrames;
+	}
+
+	void Grid3D::StoreFrame(pair<int, int> key)
+	{
+		int size = dimx * dimy * dimz;
+		CachedFrame3D &entry = frameCache[key];
+		entry.types = new unsigned char[size];
+		memcpy(entry.types, types, size);
+		entry.numBoundNodes = numBoundNodes;
+		entry.boundIndices = new int[numBoundNodes];
+		memcpy(entry.boundIndices, boundIndices, sizeof(int) * numBoundNodes);
+		entry.boundNodes = new Node[numBoundNodes];
+		std::copy(boundNodes, boundNodes + numBoundNodes, entry.boundNodes);
+	}
+
+	void Grid3D::RestoreFrame(const CachedFrame3D &entry)
+	{
+		for (int i = 0; i < dimx; i++)
+			for (int j = 0; j < dimy; j++)
+				for (int k = 0; k < dimz; k++)
+				{
+					int id = i * dimy * dimz + j * dimz + k;
+					if (types[id] != entry.types[id])
+					{
+						types[id] = entry.types[id];
+						MarkDirtyRows(i, j, k);
+					}
+				}
+
+		if (boundIndices != NULL) delete [] boundIndices;
+		if (boundNodes != NULL) delete [] boundNodes;
+		numBoundNodes = entry.numBoundNodes;
+		boundIndices = new int[numBoundNodes];
+		memcpy(boundIndices, entry.boundIndices, sizeof(int) * numBoundNodes);
+		boundNodes = new Node[numBoundNodes];
+		std::copy(entry.boundNodes, entry.boundNodes + numBoundNodes, boundNodes);
+	}
+
+	bool Grid3D::HasDirtyRows()
+	{
+		int rows[3] = { dimy * dimz, dimx * dimz, dimx * dimy };
+		for (int dir = X; dir <= Z; dir++)
+			if (dirtyRows[dir] == NULL || segCache[dir] == NULL || memchr(dirtyRows[dir], 1, rows[dir]) != NULL)
+				return true;
+		return false;
+	}
+
+	void Grid3D::MarkDirtyRows(int i, int j, int k)
+	{
+		dirtyRows[X][j * dimz + k] = 1;
+		dirtyRows[Y][i * dimz + k] = 1;
+		dirtyRows[Z][i * dimy + j] = 1;
+	}
+
+	void Grid3D::ExpandNodes()
+	{
+		int size = dimx * dimy * dimz;
+		nodes = new Node[size];
+		for (int i = 0; i < size; i++)
+		{
+			nodes[i].type = (NodeType)types[i];
+			nodes[i].bc_vel = BC_NOSLIP;
+			nodes[i].bc_temp = BC_NOSLIP;
+			nodes[i].v = Vec3D(0.0, 0.0, 0.0);
+			nodes[i].T = (FTYPE)baseT;
+		}
+		for (int b = 0; b < numBoundNodes; b++)
+			nodes[boundIndices[b]] = boundNodes[b];
+	}
+
+	void Grid3D::CompactNodes()
+	{
+		int size = dimx * dimy * dimz;
+		if (types == NULL)
+		{
+			types = new unsigned char[size];
+			memset(types, NODE_OUT, size);
+			dirtyRows[X] = new unsigned char[dimy * dimz];
+			dirtyRows[Y] = new unsigned char[dimx * dimz];
+			dirtyRows[Z] = new unsigned char[dimx * dimy];
+			memset(dirtyRows[X], 1, dimy * dimz);
+			memset(dirtyRows[Y], 1, dimx * dimz);
+			memset(dirtyRows[Z], 1, dimx * dimy);
+		}
+
+		// mark the X, Y and Z rows through every node whose type changed since the previous build
+		numBoundNodes = 0;
+		for (int i = 0; i < dimx; i++)
+			for (int j = 0; j < dimy; j++)
+				for (int k = 0; k < dimz; k++)
+				{
+					int id = i * dimy * dimz + j * dimz + k;
+					if (types[id] != nodes[id].type)
+					{
+						types[id] = (unsigned char)nodes[id].type;
+						MarkDirtyRows(i, j, k);
+					}
+					if (nodes[id].type == NODE_BOUND || nodes[id].type == NODE_VALVE) numBoundNodes++;
+				}
+
+		if (boundIndices != NULL) delete [] boundIndices;
+		if (boundNodes != NULL) delete [] boundNodes;
+		boundIndices = new int[numBoundNodes];
+		boundNodes = new Node[numBoundNodes];
+		int b = 0;
+		for (int i = 0; i < size; i++)
+			if (nodes[i].type == NODE_BOUND || nodes[i].type == NODE_VALVE)
+			{
+				boundIndices[b] = i;
+				boundNodes[b] = nodes[i];
+				b++;
+			}
+
+		delete [] nodes;
+		nodes = NULL;
+	}
+
+	void Grid3D::BuildBricks()
+	{
+		bricksx = (dimx + BRICK_SIZE - 1) / BRICK_SIZE;
+		bricksy = (dimy + BRICK_SIZE - 1) / BRICK_SIZE;
+		bricksz = (dimz + BRICK_SIZE - 1) / BRICK_SIZE;
+		int numColumns = bricksx * bricksy;
+		int numBricks = numColumns * bricksz;
+
+		// a brick keeps its state unless a node type changed in one of its (i, j) rows,
+		// the Z dirty rows mark exactly these rows since the last segment lists
+		char *wet = new char[numBricks];
+		char *stale = new char[numColumns];
+		memset(wet, 0, numBricks);
+		if (wetBricks != NULL && dirtyRows[Z] != NULL)
+		{
+			for (int n = 0; n < numWetBricks; n++)
+				wet[wetBricks[n]] = 1;
+			memset(stale, 0, numColumns);
+			for (int i = 0; i < dimx; i++)
+				for (int j = 0; j < dimy; j++)
+					if (dirtyRows[Z][i * dimy + j])
+						stale[(i / BRICK_SIZE) * bricksy + j / BRICK_SIZE] = 1;
+		}
+		else
+			memset(stale, 1, numColumns);
+
+		// a brick column is scanned by one thread, which stops at the first wet node of each brick
+		#pragma omp parallel for default(none) firstprivate(wet, stale, numColumns) schedule(dynamic)
+		for (int c = 0; c < numColumns; c++)
+		{
+			if (!stale[c]) continue;
+			int i0 = (c / bricksy) * BRICK_SIZE, i1 = min(i0 + BRICK_SIZE, dimx);
+			int j0 = (c % bricksy) * BRICK_SIZE, j1 = min(j0 + BRICK_SIZE, dimy);
+			for (int b = 0; b < bricksz; b++)
+			{
+				int k0 = b * BRICK_SIZE, k1 = min(k0 + BRICK_SIZE, dimz);
+				char res = 0;
+				for (int i = i0; i < i1 && !res; i++)
+					for (int j = j0; j < j1 && !res; j++)
+						for (int k = k0; k < k1; k++)
+							if (types[i * dimy * dimz + j * dimz + k] != NODE_OUT)
+							{
+								res = 1;
+								break;
+							}
+				wet[c * bricksz + b] = res;
+			}
+		}
+
+		if (wetBricks == NULL) wetBricks = new int[numBricks];
+		numWetBricks = 0;
+		for (int b = 0; b < numBricks; b++)
+			if (wet[b]) wetBricks[numWetBricks++] = b;
+		delete [] stale;
+		delete [] wet;
+	}
+
+	void Grid3D::BuildSpans()
+	{
+		if (rowSpans == NULL) rowSpans = new int[dimx * dimy + 1];
+
+		// count first, then fill
+		int num = 0;
+		for (int row = 0; row < dimx * dimy; row++)
+		{
+			const unsigned char *t = types + row * dimz;
+			rowSpans[row] = num;
+			for (int k = 0; k < dimz; k++)
+				if (k == 0 || t[k] != t[k-1]) num++;
+		}
+		rowSpans[dimx * dimy] = num;
+
+		if (spans != NULL) delete [] spans;
+		spans = new NodeSpan[num];
+		for (int row = 0; row < dimx * dimy; row++)
+		{
+			const unsigned char *t = types + row * dimz;
+			NodeSpan *s = spans + rowSpans[row] - 1;
+			for (int k = 0; k < dimz; k++)
+			{
+				if (k == 0 || t[k] != t[k-1])
+				{
+					s++;
+					s->k0 = k;
+					s->type = (NodeType)t[k];
+				}
+				s->k1 = k + 1;
+			}
+		}
 	}
 
 	void Grid3D::Prepare_GPU()
@@ -538,8 +1440,8 @@ namespace FluidSolver3D
 				{
 					int id = (i) * dimy * dimz + j * dimz + k;
 					int idT = (i) * dimy * dimz + k * dimy + j;
-					nodeTypes[id - dimxOffset*dimy*dimz] = nodes[id].type;
-					nodeTypesT[id - dimxOffset*dimy*dimz] = nodes[idT].type;
+					nodeTypes[id - dimxOffset*dimy*dimz] = (NodeType)types[id];
+					nodeTypesT[id - dimxOffset*dimy*dimz] = (NodeType)types[idT];
 				}
 #if (TRANSPOSE_OPT == 1)		
 		// currently implemented on CPU but it's possible to do a transpose on GPU
@@ -687,27 +1589,32 @@ namespace FluidSolver3D
 	}
 
 	// project the point back on the original 3D polygon and fill nodes
-	void Grid3D::ProjectPointOnPolygon(DirType dir, int i, int j, Vec2D testp, Vec3D n, FTYPE d)
+	void Grid3D::ProjectPointOnPolygon(DirType dir, int i, int j, Vec2D testp, Vec3D n, FTYPE d, int x0, int x1, int *reach)
 	{
 		int k;
 		switch( dir )
 		{
 		case X: 
 			k = (int)((-d-testp.dot(Vec2D(n.y, n.z)))/n.x); 
-			if( k >= 0 && k < dimx ) SetType(k, i, j, NODE_BOUND);
+			if( reach != NULL ) ExtendReach(reach, k);
+			else if( k >= x0 && k < x1 ) SetType(k, i, j, NODE_BOUND);
 			break;
 		case Y: 
 			k = (int)((-d-testp.dot(Vec2D(n.x, n.z)))/n.y); 
-			if( k >= 0 && k < dimy ) SetType(i, k, j, NODE_BOUND);
+			if( k < 0 || k >= dimy ) break;
+			if( reach != NULL ) ExtendReach(reach, i);
+			else if( i >= x0 && i < x1 ) SetType(i, k, j, NODE_BOUND);
 			break;
 		case Z: 
 			k = (int)((-d-testp.dot(Vec2D(n.x, n.y)))/n.z); 
-			if( k >= 0 && k < dimz ) SetType(i, j, k, NODE_BOUND);
+			if( k < 0 || k >= dimz ) break;
+			if( reach != NULL ) ExtendReach(reach, i);
+			else if( i >= x0 && i < x1 ) SetType(i, j, k, NODE_BOUND);
 			break;
 		}
 	}
 
-	void Grid3D::RasterPolygon(Vec3D p1, Vec3D p2, Vec3D p3, Vec3D v1, Vec3D v2, Vec3D v3, NodeType color)
+	void Grid3D::RasterPolygon(Vec3D p1, Vec3D p2, Vec3D p3, Vec3D v1, Vec3D v2, Vec3D v3, NodeType color, int x0, int x1, int *reach)
     {
 		// if zero polygon then immediate exit
 		if( p1.equal(p2) && p1.equal(p3) ) return; 
@@ -767,7 +1674,7 @@ namespace FluidSolver3D
 			int last_i = (int)GetIntersectHorizon(pp1, pp2, p).x;
 
 			for (int i = (int)p.x; i != last_i + di; i += di)
-				ProjectPointOnPolygon(dir, i, j, Vec2D((FTYPE)i, p.y), n, d);
+				ProjectPointOnPolygon(dir, i, j, Vec2D((FTYPE)i, p.y), n, d, x0, x1, reach);
 
 			p += dp1;			
         }
@@ -781,13 +1688,13 @@ namespace FluidSolver3D
 			int last_i = (int)GetIntersectHorizon(pp2, pp3, p).x;
 
 			for (int i = (int)p.x; i != last_i + di; i += di)
-				ProjectPointOnPolygon(dir, i, j, Vec2D((FTYPE)i, p.y), n, d);
+				ProjectPointOnPolygon(dir, i, j, Vec2D((FTYPE)i, p.y), n, d, x0, x1, reach);
 
 			p += dp2;			
         }
 	}
 
-	void Grid3D::RasterLine(Vec3D p1, Vec3D p2, Vec3D v1, Vec3D v2, NodeType color)
+	void Grid3D::RasterLine(Vec3D p1, Vec3D p2, Vec3D v1, Vec3D v2, NodeType color, int x0, int x1, int *reach)
     {
 		Vec3D dir = p2 - p1;
 		int steps = (int)max(abs(dir.x), max(abs(dir.y), abs(dir.z))) + 1;
@@ -802,7 +1709,8 @@ namespace FluidSolver3D
             int y = (int)p.y;
 			int z = (int)p.z;
 			
-			SetType(x, y, z, color);
+			if (reach != NULL) ExtendReach(reach, x);
+			else if (x >= x0 && x < x1) SetType(x, y, z, color);
 
 			p += dp;
         }
@@ -810,78 +1718,157 @@ namespace FluidSolver3D
 
 	void Grid3D::FloodFill(int start[3], NodeType color, int n, const int *neighborPos)
     {
-		int *queue = new int[dimx * dimy * dimz * 3];
-		int cur = -1;
+		// scanline fill: a seed grows into the run of NODE_IN nodes around it along Z, then every
+		// run of NODE_IN nodes the grown run reaches through the neighbours in the other rows
+		// becomes a new seed; neighbours along Z itself are expected to be (0, 0, +-1)
+		fillStack.clear();
+		fillStack.push_back(start[0]);
+		fillStack.push_back(start[1]);
+		fillStack.push_back(start[2]);
 
 		// we know that this cell is of our color type
-		int last = 0;
-		queue[0] = start[0];
-		queue[1] = start[1];
-		queue[2] = start[2];
-		SetType(start[0], start[1], start[2], color);
-
-		// run wave
-		while (cur < last)
+		bool first = true;
+		while (!fillStack.empty())
 		{
-			// get next index
-			cur++;
-			int i = queue[cur * 3 + 0];
-			int j = queue[cur * 3 + 1];
-			int k = queue[cur * 3 + 2];
+			int k = fillStack.back(); fillStack.pop_back();
+			int j = fillStack.back(); fillStack.pop_back();
+			int i = fillStack.back(); fillStack.pop_back();
+
+			// a seed may have been filled by another run since it was pushed
+			if (!first && GetType(i, j, k) != NODE_IN) continue;
+			first = false;
+
+			int k0 = k, k1 = k;
+			SetType(i, j, k, color);
+			while (k0 > 0 && GetType(i, j, k0-1) == NODE_IN) SetType(i, j, --k0, color);
+			while (k1 < dimz-1 && GetType(i, j, k1+1) == NODE_IN) SetType(i, j, ++k1, color);
 
-			// add neighbors
 			for (int t = 0; t < n; t++)
 			{
 				int next_i = i + neighborPos[t * 3 + 0];
 				int next_j = j + neighborPos[t * 3 + 1];
-				int next_k = k + neighborPos[t * 3 + 2];
+				int dk = neighborPos[t * 3 + 2];
+				if ((next_i == i && next_j == j) || next_i < 0 || next_i >= dimx || next_j < 0 || next_j >= dimy)
+					continue;
 
-				if ((next_i >= 0) && (next_i < dimx) && (next_j >= 0) && (next_j < dimy) && (next_k >= 0) && (next_k < dimz))
-					if (GetType(next_i, next_j, next_k) == NODE_IN) 
+				// push the first node of every run of inner nodes in the reached range
+				bool inRun = false;
+				for (int next_k = max(0, k0 + dk); next_k <= min(dimz-1, k1 + dk); next_k++)
+				{
+					bool inner = (GetType(next_i, next_j, next_k) == NODE_IN);
+					if (inner && !inRun)
 					{
-						last++;
-						queue[last * 3 + 0] = next_i;
-						queue[last * 3 + 1] = next_j;
-						queue[last * 3 + 2] = next_k;
-						SetType(next_i, next_j, next_k, color);
+						fillStack.push_back(next_i);
+						fillStack.push_back(next_j);
+						fillStack.push_back(next_k);
 					}
+					inRun = inner;
+				}
 			}
 		}
+	}
 
-		delete [] queue;
+	void Grid3D::GetPolygonTiles(Shape3D &shape, int poly, int tileSize, int numTiles, int &t0, int &t1)
+	{
+		// run the rasterizers in the measuring mode, so the range is exactly the nodes they write
+		int i1 = shape.Indices[poly*3+0];
+		int i2 = shape.Indices[poly*3+1];
+		int i3 = shape.Indices[poly*3+2];
+		int reach[2] = { dimx, -1 };
+		RasterPolygon(shape.Vertices[i1], shape.Vertices[i2], shape.Vertices[i3],
+					  shape.Velocities[i1], shape.Velocities[i2], shape.Velocities[i3], NODE_BOUND, 0, dimx, reach);
+		RasterLine(shape.Vertices[i1], shape.Vertices[i2], shape.Velocities[i1], shape.Velocities[i2], NODE_BOUND, 0, dimx, reach);
+		RasterLine(shape.Vertices[i1], shape.Vertices[i3], shape.Velocities[i1], shape.Velocities[i3], NODE_BOUND, 0, dimx, reach);
+		RasterLine(shape.Vertices[i3], shape.Vertices[i2], shape.Velocities[i3], shape.Velocities[i2], NODE_BOUND, 0, dimx, reach);
+
+		// an empty range if the polygon writes no node inside the grid
+		reach[0] = max(reach[0], 0);
+		reach[1] = min(reach[1], dimx - 1);
+		t0 = (reach[0] <= reach[1]) ? reach[0] / tileSize : numTiles;
+		t1 = (reach[0] <= reach[1]) ? min(numTiles - 1, reach[1] / tileSize) : numTiles - 1;
 	}
 
 	void Grid3D::Build(FrameInfo3D &frame)
 	{
 		// mark all cells as inner 
+		#pragma omp parallel for default(none)
 		for (int i = 0; i < dimx; i++)
 			for (int j = 0; j < dimy; j++)
 				for (int k = 0; k < dimz; k++)
 					SetType(i, j, k, NODE_IN);
-     
-		// rasterize polygons (boundary)
+
+		// bin the polygons into slabs along X, a polygon goes to every slab it may touch;
+		// a slab is rasterized by one thread that writes only its own nodes, so no two threads
+		// ever write the same node and the result does not depend on the order
+		int tileSize = max(BRICK_SIZE, dimx / (GetMaxThreads() * 4));
+		int numTiles = (dimx + tileSize - 1) / tileSize;
+		int numPolys = 0;
 		for( int s = 0; s < frame.NumShapes; s++ )
-			for( int i = 0; i < frame.Shapes[s].NumIndices; i++ )
-				if( !frame.Shapes[s].Active )
-				{
-					int i1 = frame.Shapes[s].Indices[i*3+0];
-					int i2 = frame.Shapes[s].Indices[i*3+1];
-					int i3 = frame.Shapes[s].Indices[i*3+2];
-					RasterPolygon(frame.Shapes[s].Vertices[i1], frame.Shapes[s].Vertices[i2], frame.Shapes[s].Vertices[i3],
-								  frame.Shapes[s].Velocities[i1], frame.Shapes[s].Velocities[i2], frame.Shapes[s].Velocities[i3],
-								  NODE_BOUND);
-
-					// additionally rasterize all edges to cover holes
-					RasterLine(frame.Shapes[s].Vertices[i1], frame.Shapes[s].Vertices[i2], frame.Shapes[s].Velocities[i1], frame.Shapes[s].Velocities[i2], NODE_BOUND);
-					RasterLine(frame.Shapes[s].Vertices[i1], frame.Shapes[s].Vertices[i3], frame.Shapes[s].Velocities[i1], frame.Shapes[s].Velocities[i3], NODE_BOUND);
-					RasterLine(frame.Shapes[s].Vertices[i3], frame.Shapes[s].Vertices[i2], frame.Shapes[s].Velocities[i3], frame.Shapes[s].Velocities[i2], NODE_BOUND);
-				}
+			if( !frame.Shapes[s].Active ) numPolys += frame.Shapes[s].NumIndices;
+
+		// the slab range of each polygon is measured once and reused by both passes below
+		int *polyTiles = new int[numPolys * 2];
+		for( int s = 0, first = 0; s < frame.NumShapes; s++ )
+			if( !frame.Shapes[s].Active )
+			{
+				Shape3D &shape = frame.Shapes[s];
+				#pragma omp parallel for default(none) firstprivate(tileSize, numTiles, first) shared(shape, polyTiles)
+				for( int i = 0; i < shape.NumIndices; i++ )
+					GetPolygonTiles(shape, i, tileSize, numTiles, polyTiles[(first + i) * 2 + 0], polyTiles[(first + i) * 2 + 1]);
+				first += shape.NumIndices;
+			}
+
+		int *tileFirst = new int[numTiles + 2];
+		memset(tileFirst, 0, sizeof(int) * (numTiles + 2));
+		for( int p = 0; p < numPolys; p++ )
+			for (int t = polyTiles[p * 2 + 0]; t <= polyTiles[p * 2 + 1]; t++) tileFirst[t + 2]++;
+		for (int t = 0; t < numTiles; t++)
+			tileFirst[t + 2] += tileFirst[t + 1];
+
+		int *tilePolys = new int[tileFirst[numTiles + 1] * 2];
+		for( int s = 0, p = 0; s < frame.NumShapes; s++ )
+			if( !frame.Shapes[s].Active )
+				for( int i = 0; i < frame.Shapes[s].NumIndices; i++, p++ )
+					for (int t = polyTiles[p * 2 + 0]; t <= polyTiles[p * 2 + 1]; t++)
+					{
+						int pos = tileFirst[t + 1]++;
+						tilePolys[pos * 2 + 0] = s;
+						tilePolys[pos * 2 + 1] = i;
+					}
+		delete [] polyTiles;
+
+		// rasterize polygons (boundary)
+		#pragma omp parallel for default(none) firstprivate(tileSize, numTiles) shared(frame, tileFirst, tilePolys) schedule(dynamic)
+		for (int t = 0; t < numTiles; t++)
+		{
+			int x0 = t * tileSize;
+			int x1 = min(x0 + tileSize, dimx);
+			for (int p = tileFirst[t]; p < tileFirst[t + 1]; p++)
+			{
+				Shape3D &shape = frame.Shapes[tilePolys[p * 2 + 0]];
+				int i = tilePolys[p * 2 + 1];
+				int i1 = shape.Indices[i*3+0];
+				int i2 = shape.Indices[i*3+1];
+				int i3 = shape.Indices[i*3+2];
+				RasterPolygon(shape.Vertices[i1], shape.Vertices[i2], shape.Vertices[i3],
+							  shape.Velocities[i1], shape.Velocities[i2], shape.Velocities[i3],
+							  NODE_BOUND, x0, x1);
+
+				// additionally rasterize all edges to cover holes
+				RasterLine(shape.Vertices[i1], shape.Vertices[i2], shape.Velocities[i1], shape.Velocities[i2], NODE_BOUND, x0, x1);
+				RasterLine(shape.Vertices[i1], shape.Vertices[i3], shape.Velocities[i1], shape.Velocities[i3], NODE_BOUND, x0, x1);
+				RasterLine(shape.Vertices[i3], shape.Vertices[i2], shape.Velocities[i3], shape.Velocities[i2], NODE_BOUND, x0, x1);
+			}
+		}
+		delete [] tilePolys;
+		delete [] tileFirst;
 
 		// detect all outside nodes by running wave algorithm
 		const int neighborPos[18] = { -1, 0, 0,  1, 0, 0,  0, -1, 0,  0, 1, 0,  0, 0, -1,  0, 0, 1 };
 		int start[3] = { 0, 0, 0 };
 		FloodFill(start, NODE_OUT, 6, neighborPos); 
 		
+		#pragma omp parallel for default(none)
 		for (int i = 0; i < dimx; i++)
 			for (int j = 0; j < dimy; j++)
 				for (int k = 0; k < dimz; k++)
@@ -944,7 +1931,7 @@ namespace FluidSolver3D
 		}
 	}
 
-	void Grid3D::Prepare3D_Shape(double time)
+	void Grid3D::FindSubframe(double time, int &frame, double &substep)
 	{
 		double* a = new double[num_frames + 1];
 		a[0] = 0;
@@ -952,12 +1939,24 @@ namespace FluidSolver3D
 			a[i] = a[i-1] + frames[i-1].Duration;
 
 		double r_time = fmod(time, a[num_frames]);
-		int frame = 0;
+		frame = 0;
 		for (int i=1; i<num_frames; i++)
 			if (a[i] < r_time) frame = i;
-		double substep = (r_time - a[frame]) / (a[frame + 1] - a[frame]);
+		substep = (r_time - a[frame]) / (a[frame + 1] - a[frame]);
 		delete[] a;
 
+		// with the cache on, the geometry is built at the subframes it is keyed by,
+		// so a replayed subframe is exactly what a rebuild would produce
+		if (frameCacheSize > 0)
+			substep = floor(substep * FRAME_CACHE_STEPS + 0.5) / FRAME_CACHE_STEPS;
+	}
+
+	void Grid3D::Prepare3D_Shape(double time)
+	{
+		int frame;
+		double substep;
+		FindSubframe(time, frame, substep);
+
 		FrameInfo3D info;
 		ComputeSubframeInfo(frame % num_frames, (FTYPE)substep, info);
 		Build(info);
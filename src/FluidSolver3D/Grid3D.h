@@ -35,12 +35,23 @@
 
 #include <cuda_runtime.h>
 #include <netcdf.h>
+#include <map>
 
 #define TRANSPOSE_OPT 1
 
 using namespace Common;
 
 #define MAX_SEGS_PER_ROW	2
+#define BRICK_SIZE			8		// edge of the bricks the CPU field passes are split into
+#define PAGE_BYTES			4096	// granularity the OS commits the zeroed CPU field memory at
+#define FRAME_CACHE_STEPS	4096	// subframes per input frame the cached geometry is keyed by
+
+#define MESH_MAGIC			"FSMESH3D"	// first bytes of a binary 3D shape file
+#define MESH_VERSION		1
+#define MESH_ALIGN			16		// every block of a binary 3D shape file starts at a multiple of it
+
+#define GRID_CACHE_MAGIC	"FSGRID3D"	// first bytes of a startup cache file
+#define GRID_CACHE_VERSION	1
 
 namespace FluidSolver3D
 {
@@ -87,6 +98,21 @@ namespace FluidSolver3D
 		}
 	};
 
+	struct NodeSpan
+	{
+		int k0, k1;		// run of nodes [k0, k1) of the same type along Z
+		NodeType type;
+	};
+
+	// compact grid of one subframe, replayed by Grid3D in later cycles
+	struct CachedFrame3D
+	{
+		unsigned char *types;
+		int numBoundNodes;
+		int *boundIndices;
+		Node *boundNodes;
+	};
+
 	struct NodesBoundary3D
 	{
 		Node first, last; // first and last node of a 3D segment
@@ -109,6 +135,7 @@ namespace FluidSolver3D
 
 		void GenerateListSegments(int &numSeg, Segment3D *h_list, int dim1, int dim2, int dim3, DirType dir, int nblockZ);
 		void GenerateGridBoundaries(NodesBoundary3D *node_list, int numSeg, Segment3D *h_list, bool transposed);
+		bool HasDirtyRows();		// true if a node type changed since the last segment lists
 		void SplitSegments_X(int *splitting);
 
 		NodeType GetType(int i, int j, int k);
@@ -117,13 +144,30 @@ namespace FluidSolver3D
 		Vec3D GetVel(int i, int j, int k);
 		FTYPE GetT(int i, int j, int k);
 
+		// only meaningful while Prepare_CPU builds the grid
 		void SetType(int i, int j, int k, NodeType type);
 		void SetData(int i, int j, int k, BCtype bc_vel, BCtype bc_T, const Vec3D &vel, FTYPE T);
 
-		// return all nodes info as an array
-		Node *GetNodesCPU();							 
+		// return all node types as an array of bytes, valid after Prepare_CPU
+		const unsigned char *GetTypesCPU();
+		int GetNumNodes(NodeType type);
+
+		// NODE_BOUND and NODE_VALVE records sorted by node index, valid after Prepare_CPU
+		int GetNumBoundNodes();
+		const int *GetBoundIndices();
+		const Node *GetBoundNodes();
+
+		// bricks of BRICK_SIZE^3 nodes with at least one node other than NODE_OUT, refreshed by Prepare_CPU;
+		// the whole-layer CPU copies visit only these, so the dry part of the fields is never touched
+		int GetNumWetBricks();
+		void GetBrickRange(int n, int &i0, int &i1, int &j0, int &j1, int &k0, int &k1);
+		// bytes of the PAGE_BYTES pages of a dense field that hold a node of a wet brick, i.e. what the passes commit
+		long long GetWetPageBytes(int elemSize);
 		NodeType **GetTypesGPU(bool transposed = false);
 
+		// run-length spans of the (i, j) row along Z, refreshed by Prepare_CPU
+		const NodeSpan *GetRowSpans(int i, int j, int &num);
+
 		void SetNodeVel(int i, int j, int k, Vec3D new_v);
 
 		// frame stuff
@@ -133,12 +177,20 @@ namespace FluidSolver3D
 		int GetFrame(double time);
 		float GetLayerTime(double time);
 		void SetFrameTime(double time);
+		void SetFrameCache(int maxFrames);		// subframes of a 3D shape kept for the next cycles, 0 disables
 		void SetBoundParams(const Vec3D &vec, const double &temp);
 
 		FluidSolver2D::Grid2D *GetGrid2D();
 		DepthInfo3D *GetDepthInfo();
 		
 		bool LoadFromFile(char *filename, bool align = false);		
+		static bool ConvertShape(char *textFile, char *meshFile);		// text 3D shape to the binary format
+
+		// startup cache: the built grid with the segment rows of the last lists, so a run with
+		// the same input and grid parameters skips the first build; 3D inputs only
+		unsigned long long GetCacheKey(char *filename, bool align);
+		bool LoadCache(char *filename, unsigned long long key);
+		bool SaveCache(char *filename, unsigned long long key);
 		void Prepare(double time);		
 		void Prepare_CPU(double time);
 		void Init_GPU();
@@ -150,7 +202,31 @@ namespace FluidSolver3D
 	protected:
 		BackendType backend;
 
-		Node*		nodes;		// all grid nodes
+		Node*		nodes;		// all grid nodes, only allocated while Prepare_CPU builds the grid
+
+		// compact form kept between the builds: a type byte per node and the full records
+		// of the boundary nodes only, every other node has no-slip BCs, zero velocity and baseT
+		unsigned char *types;
+		int numBoundNodes;
+		int *boundIndices;
+		Node *boundNodes;
+
+		int bricksx, bricksy, bricksz;
+		int numWetBricks;
+		int *wetBricks;			// ids of the wet bricks, i-major as the nodes
+
+		int *rowSpans;			// first span of every (i, j) row, dimx * dimy + 1 entries
+		NodeSpan *spans;
+
+		// segments of the last list generated per direction, a row is regenerated only
+		// if the types along it changed since then; rows are keyed i * dim3 + j as in GenerateListSegments
+		unsigned char *dirtyRows[3];
+		Segment3D *segCache[3];
+		int *segCacheFirst[3], *segCacheCount[3];
+
+		// built subframes keyed by (frame, subframe of FRAME_CACHE_STEPS)
+		int frameCacheSize;
+		map<pair<int, int>, CachedFrame3D> frameCache;
 
 		NodeType** d_types; // node types stored on multiple GPUs
 		NodeType** d_typesT; // transposed node types on multiple GPU
@@ -172,23 +248,46 @@ namespace FluidSolver3D
 		// support for different input formats
 		bool LoadNetCDF(char *filename, bool align);
 		bool Load3DShape(char *filename, bool align);
+		bool LoadMesh3D(char *filename, bool align);
+		bool InitShape(bool align);
+
+		static bool IsMeshFile(char *filename);
+		static FrameInfo3D *ReadShapeText(char *filename, int &num);
+		static FrameInfo3D *ReadShapeMesh(char *filename, int &num);
+		static bool WriteShapeMesh(char *filename, FrameInfo3D *frames, int num);
 
 		// helper functions for 3D shape update
 		void Init(bool align);
 		void Prepare_GPU();
+		void BuildBricks();
+		void BuildSpans();
+		void InitSegCache();
+		void MarkDirtyRows(int i, int j, int k);
+		void FindSubframe(double time, int &frame, double &substep);
+		void StoreFrame(pair<int, int> key);
+		void RestoreFrame(const CachedFrame3D &entry);
+		int GenerateRowSegments(Segment3D *h_list, int i, int j, DirType dir);
+		void ExpandNodes();
+		void CompactNodes();
+		int FindBoundNode(int index);
+		Node GetNode(int index);
 		void Prepare3D_Shape(double time);
 		void Prepare3D_NetCDF(double time);
 
 		void ComputeSubframeInfo(int frame, FTYPE substep, FrameInfo3D &res);
 		void Build(FrameInfo3D &frame);
 		
-		void RasterPolygon(Vec3D p1, Vec3D p2, Vec3D p3, Vec3D v1, Vec3D v2, Vec3D v3, NodeType color);
-		void RasterLine(Vec3D p1, Vec3D p2, Vec3D v1, Vec3D v2, NodeType color);
+		// the rasterizers only write the nodes with x0 <= i < x1; given a reach they write nothing
+		// and widen it to the range of i they would write instead
+		void RasterPolygon(Vec3D p1, Vec3D p2, Vec3D p3, Vec3D v1, Vec3D v2, Vec3D v3, NodeType color, int x0, int x1, int *reach = NULL);
+		void RasterLine(Vec3D p1, Vec3D p2, Vec3D v1, Vec3D v2, NodeType color, int x0, int x1, int *reach = NULL);
+		void GetPolygonTiles(Shape3D &shape, int poly, int tileSize, int numTiles, int &t0, int &t1);
 		
 		double GetBarycentric(Vec2D v1, Vec2D v2, Vec2D v0, Vec2D p);
-		void ProjectPointOnPolygon(DirType dir, int i, int j, Vec2D testp, Vec3D n, FTYPE d);
+		void ProjectPointOnPolygon(DirType dir, int i, int j, Vec2D testp, Vec3D n, FTYPE d, int x0, int x1, int *reach = NULL);
 		
 		void FloodFill(int start[3], NodeType color, int n, const int *neighborPos);
+		vector<int> fillStack;				// seeds of FloodFill, kept to reuse the memory across builds
 		
 		// helper function for 2D shape update
 		void Prepare2D(double time);
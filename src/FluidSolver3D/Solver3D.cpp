@@ -20,8 +20,7 @@ namespace FluidSolver3D
 {
 	void Solver3D::GetLayer(Vec3D *v, double *T, int outdimx, int outdimy, int outdimz)
 	{
-		next->Clear(grid, NODE_OUT, MISSING_VALUE, MISSING_VALUE, MISSING_VALUE, MISSING_VALUE);
-		next->FilterToArrays(v, T, outdimx, outdimy, outdimz);
+		next->FilterToArrays(grid, v, T, outdimx, outdimy, outdimz);
 	}
 
 	void Solver3D::UpdateBoundaries()
@@ -26,6 +26,45 @@ using namespace FluidSolver3D;
 
 #include <cuda_runtime.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// the CPU loops below are split into a body with an orphaned omp for and a wrapper:
+// inside a parallel region every thread of the team calls the body and shares its iterations,
+// outside of one the wrapper opens a region of its own
+static inline bool InParallelRegion()
+{
+#ifdef _OPENMP
+	return omp_in_parallel() != 0;
+#else
+	return false;
+#endif
+}
+
+static void CopyArray_CPU(FTYPE *dest, FTYPE *src, int num)
+{
+	const int chunk = 1 << 16;
+	int numChunks = (num + chunk - 1) / chunk;
+	#pragma omp for
+	for (int c = 0; c < numChunks; c++)
+	{
+		int size = (c == numChunks - 1) ? num - c * chunk : chunk;
+		memcpy(dest + c * chunk, src + c * chunk, size * sizeof(FTYPE));
+	}
+}
+
+static void CopyArray(FTYPE *dest, FTYPE *src, int num)
+{
+	if (InParallelRegion())
+		CopyArray_CPU(dest, src, num);
+	else
+	{
+		#pragma omp parallel default(none) firstprivate(num) shared(dest, src)
+		CopyArray_CPU(dest, src, num);
+	}
+}
+
 extern void CopyFieldTo_GPU(int dimx, int dimy, int dimz, FTYPE **src, FTYPE **dest, NodeType **nodes, NodeType target, int haloSize);
 extern void MergeFieldTo_GPU(int dimx, int dimy, int dimz, FTYPE **src, FTYPE **dest, NodeType **nodes, NodeType target, int haloSize);
 extern void CopyFromGrid_GPU(int dimx, int dimy, int dimz, FTYPE **u, FTYPE **v, FTYPE **w, FTYPE **T, Node **nodes, NodeType target, int haloSize);
@@ -350,7 +389,9 @@ template <typename T, SwipeType swipe>
 			dimxOffset = pplan->getOffset1D();
 			switch( hw )
 			{
-			case CPU: u = new FTYPE[dimx * dimy * dimz + 2 * haloSize]; break;
+			// zero pages: the CPU passes skip the dry bricks, so a page whose nodes all lie in dry bricks
+			// is never committed; the layout stays dense, Grid3D::GetWetPageBytes tells what is
+			case CPU: u = (FTYPE*)calloc(dimx * dimy * dimz + 2 * haloSize, sizeof(FTYPE)); break;
 			case GPU: multiDevAlloc<FTYPE>(dd_u, dimx * dimy * dimz, true, 2 * haloSize); break;
 			}
 		}
@@ -364,7 +405,7 @@ template <typename T, SwipeType swipe>
 			switch( hw )
 			{
 			case CPU: 
-				u = new FTYPE[dimx * dimy * dimz + 2 * haloSize]; 
+				u = (FTYPE*)calloc(dimx * dimy * dimz + 2 * haloSize, sizeof(FTYPE)); 
 				switch( field->hw )
 				{
 				case CPU: memcpy(u + haloSize, field->getArray() + haloSize, dimx * dimy * dimz * sizeof(FTYPE)); break;
@@ -386,7 +427,7 @@ template <typename T, SwipeType swipe>
 		{
 			switch( hw )
 			{
-			case CPU: delete [] u; break;
+			case CPU: free(u); break;
 			case GPU: multiDevFree<FTYPE>(dd_u); break;
 			}
 		}
@@ -397,11 +438,13 @@ template <typename T, SwipeType swipe>
 			{
 			case CPU:
 				{
-					for (int i = 0; i < dimx; i++)
-						for (int j = 0; j < dimy; j++)
-							for (int k = 0; k < dimz; k++)
-								if (grid->GetType(i + dimxOffset, j, k) == type)
-									dest->elem(i, j, k) = elem(i, j, k);
+					if (InParallelRegion())
+						CopyFieldTo_CPU(grid, dest, type);
+					else
+					{
+						#pragma omp parallel default(none) firstprivate(type) shared(grid, dest)
+						CopyFieldTo_CPU(grid, dest, type);
+					}
 					break;
 				}
 			case GPU: 
@@ -412,29 +455,61 @@ template <typename T, SwipeType swipe>
 			}
 		}
 
-	void MergeFieldTo(Node *nodes, ScalarField3D *dest, NodeType type)
+		void CopyFieldTo_CPU(Grid3D *grid, ScalarField3D *dest, NodeType type)
+		{
+			#pragma omp for
+			for (int row = 0; row < dimx * dimy; row++)
+			{
+				int i = row / dimy, j = row % dimy, num;
+				const NodeSpan *spans = grid->GetRowSpans(i + dimxOffset, j, num);
+				FTYPE *src_row = &elem(i, j, 0);
+				FTYPE *dest_row = &dest->elem(i, j, 0);
+				for (int s = 0; s < num; s++)
+					if (spans[s].type == type)
+						memcpy(dest_row + spans[s].k0, src_row + spans[s].k0, sizeof(FTYPE) * (spans[s].k1 - spans[s].k0));
+			}
+		}
+
+	// zStart, zEnd restrict the merge to a slab along Z, zEnd < 0 means up to dimz
+	void MergeFieldTo(Grid3D *grid, ScalarField3D *dest, NodeType type, int zStart = 0, int zEnd = -1)
 	{
+		if (zEnd < 0) zEnd = dimz;
 		switch( hw )
 		{
 		case CPU:
 			{
-				#pragma omp parallel default(none) firstprivate(type) shared(nodes, dest)
+				if (InParallelRegion())
+					MergeFieldTo_CPU(grid, dest, type, zStart, zEnd);
+				else
 				{
-					#pragma omp for
-					for (int i = 0; i < dimx; i++)
-						for (int j = 0; j < dimy; j++)
-							for (int k = 0; k < dimz; k++)
-							{
-								int id = (i + dimxOffset) * dimy * dimz + j * dimz + k;
-								if (nodes[id].type == type)
-									dest->elem(i, j, k) = (dest->elem(i, j, k) + elem(i, j, k)) / 2;
-							}
+					#pragma omp parallel default(none) firstprivate(type, zStart, zEnd) shared(grid, dest)
+					MergeFieldTo_CPU(grid, dest, type, zStart, zEnd);
 				}
 				break;
 			}
 		}
 	}
 
+	void MergeFieldTo_CPU(Grid3D *grid, ScalarField3D *dest, NodeType type, int zStart, int zEnd)
+	{
+		#pragma omp for
+		for (int row = 0; row < dimx * dimy; row++)
+		{
+			int i = row / dimy, j = row % dimy, num;
+			const NodeSpan *spans = grid->GetRowSpans(i + dimxOffset, j, num);
+			FTYPE *src_row = &elem(i, j, 0);
+			FTYPE *dest_row = &dest->elem(i, j, 0);
+			for (int s = 0; s < num; s++)
+				if (spans[s].type == type)
+				{
+					int k0 = max(spans[s].k0, zStart);
+					int k1 = min(spans[s].k1, zEnd);
+					for (int k = k0; k < k1; k++)
+						dest_row[k] = (dest_row[k] + src_row[k]) / 2;
+				}
+		}
+	}
+
 		void MergeFieldTo(NodeType **nodes, ScalarField3D *dest, NodeType type)
 		{
 			switch( hw )
@@ -447,25 +522,27 @@ template <typename T, SwipeType swipe>
 			}
 		}
 
-		void Smooth(Node *nodes, ScalarField3D *dest, NodeType type)
+		void Smooth(Grid3D *grid, ScalarField3D *dest, NodeType type)
 		{
 			switch( hw )
 			{
 			case CPU:
 				{
-					#pragma omp parallel default(none) firstprivate(type) shared(nodes, dest)
+					#pragma omp parallel default(none) firstprivate(type) shared(grid, dest)
 					{
 						#pragma omp for
 						for (int i = 0; i < dimx; i++)
 							for (int j = 0; j < dimy; j++)
-								for (int k = 0; k < dimz; k++)
-								{
-									int id = i * dimy * dimz + j * dimz + k;
-									if (nodes[id].type == type)
-										dest->elem(i, j, k) = (elem(i, j, k) + elem(i+1, j, k) + elem(i-1, j, k) + 
-															   elem(i, j-1, k) + elem(i, j+1, k) + 
-															   elem(i, j, k-1) + elem(i, j, k+1)) / 7;
-								}
+							{
+								int num;
+								const NodeSpan *spans = grid->GetRowSpans(i, j, num);
+								for (int s = 0; s < num; s++)
+									if (spans[s].type == type)
+										for (int k = spans[s].k0; k < spans[s].k1; k++)
+											dest->elem(i, j, k) = (elem(i, j, k) + elem(i+1, j, k) + elem(i-1, j, k) + 
+																   elem(i, j-1, k) + elem(i, j+1, k) + 
+																   elem(i, j, k-1) + elem(i, j, k+1)) / 7;
+							}
 					}
 					break;
 				}
@@ -606,6 +683,7 @@ template <typename T, SwipeType swipe>
 			int ndimx = (pplan->rank() == pplan->size()-1)? dimx-1:dimx;
 			double err = 0.0;
 			int count = 0;
+			#pragma omp parallel for default(none) firstprivate(ndimx) shared(grid, U_cpu, V_cpu, W_cpu) reduction(+:err, count)
 			for (int i = 0; i < ndimx; i++)
 				for (int j = 0; j < dimy-1; j++)
 					for (int k = 0; k < dimz-1; k++)
@@ -640,17 +718,75 @@ template <typename T, SwipeType swipe>
 #endif
 		}
 
+		// offsets of the nodes EvalDivError visits, in its loop order; returns their number, index == NULL only counts
+		int BuildDivIndex(Grid3D *grid, int *index)
+		{
+			PARAplan* pplan = PARAplan::Instance();
+			int ndimx = (pplan->rank() == pplan->size()-1)? dimx-1:dimx;
+			const unsigned char *types = grid->GetTypesCPU();
+			int num = 0;
+			for (int i = 0; i < ndimx; i++)
+				for (int j = 0; j < dimy-1; j++)
+					for (int k = 0; k < dimz-1; k++)
+						if (types[(i + dimxOffset) * dimy * dimz + j * dimz + k] == NODE_IN)
+						{
+							if (index != NULL) index[num] = i * dimy * dimz + j * dimz + k;
+							num++;
+						}
+			return num;
+		}
+
+		// CPU: same as above over the index from BuildDivIndex, reads the fields in place and skips the node types;
+		// CPU layers have no halos, so there is no MPI reduction and a single node is required
+		double EvalDivError(const int *index, int num)
+		{
+			PARAplan *pplan = PARAplan::Instance();
+			if (pplan->size() > 1)
+				throw runtime_error("EvalDivError() over an index is not supported in MPI version");
+			if (num == 0)
+				return 0.0;
+
+			const FTYPE *u = &U->elem(0, 0, 0);
+			const FTYPE *v = &V->elem(0, 0, 0);
+			const FTYPE *w = &W->elem(0, 0, 0);
+			const int si = dimy * dimz;
+			const int sj = dimz;
+			const int sk = 1;
+
+			double err = 0.0;
+			#pragma omp parallel for default(none) firstprivate(index, num, u, v, w, si, sj, sk) reduction(+:err)
+			for (int n = 0; n < num; n++)
+			{
+				int id = index[n];
+				const FTYPE *pu = u + id;
+				const FTYPE *pv = v + id;
+				const FTYPE *pw = w + id;
+
+				double err_x = (pu[0] + pu[-sj] + pu[-sj-sk] + pu[-sk] -
+					pu[-si] - pu[-si-sj] - pu[-si-sj-sk] - pu[-si-sk]) * dz * dy / 4.0;
+
+				double err_y = (pv[0] + pv[-si] + pv[-si-sk] + pv[-sk] -
+					pv[-sj] - pv[-si-sj] - pv[-si-sj-sk] - pv[-sj-sk]) * dx * dz / 4.0;
+
+				double err_z = (pw[0] + pw[-sj] + pw[-si-sj] + pw[-si] -
+					pw[-sk] - pw[-sj-sk] - pw[-si-sj-sk] - pw[-si-sk]) * dx * dy / 4.0;
+
+				err += abs(err_x + err_y + err_z);
+			}
+
+			return err / num;
+		}
+
 		void Smooth(Grid3D *grid, TimeLayer3D *dest, NodeType type)
 		{
-			Node *cpu_nodes = grid->GetNodesCPU();
 			Node **dev_nodes = NULL;// = grid->GetNodesGPU(false);
 			switch (hw)
 			{
 			case CPU:
-				U->Smooth( cpu_nodes, dest->U, type );
-				V->Smooth( cpu_nodes, dest->V, type );
-				W->Smooth( cpu_nodes, dest->W, type );
-				T->Smooth( cpu_nodes, dest->T, type );				
+				U->Smooth( grid, dest->U, type );
+				V->Smooth( grid, dest->V, type );
+				W->Smooth( grid, dest->W, type );
+				T->Smooth( grid, dest->T, type );				
 				break;
 			case GPU:
 				U->Smooth( dev_nodes, dest->U, type );
@@ -663,16 +799,15 @@ template <typename T, SwipeType swipe>
 
 		void MergeLayerTo(Grid3D *grid, TimeLayer3D *dest, NodeType type, bool transposed = false)
 		{
-			Node *cpu_nodes = grid->GetNodesCPU();
 			NodeType **dev_nodes = grid->GetTypesGPU(transposed);
 			//Node** dev_nodes = grid->GetNodesGPU();
 			switch (hw)
 			{
 			case CPU:
-				U->MergeFieldTo( cpu_nodes, dest->U, type );
-				V->MergeFieldTo( cpu_nodes, dest->V, type );
-				W->MergeFieldTo( cpu_nodes, dest->W, type );
-				T->MergeFieldTo( cpu_nodes, dest->T, type );
+				U->MergeFieldTo( grid, dest->U, type );
+				V->MergeFieldTo( grid, dest->V, type );
+				W->MergeFieldTo( grid, dest->W, type );
+				T->MergeFieldTo( grid, dest->T, type );
 				break;
 			case GPU:
 				U->MergeFieldTo( dev_nodes, dest->U, type );
@@ -682,6 +817,21 @@ template <typename T, SwipeType swipe>
 			}
 		}
 
+		void MergeLayerBlockTo(Grid3D *grid, TimeLayer3D *dest, NodeType type, int zStart, int zEnd)
+		{
+			switch (hw)
+			{
+			case CPU:
+				U->MergeFieldTo( grid, dest->U, type, zStart, zEnd );
+				V->MergeFieldTo( grid, dest->V, type, zStart, zEnd );
+				W->MergeFieldTo( grid, dest->W, type, zStart, zEnd );
+				T->MergeFieldTo( grid, dest->T, type, zStart, zEnd );
+				break;
+			case GPU:
+				throw std::logic_error("MergeLayerBlockTo: Not Implemented");
+			}
+		}
+
 		void CopyLayerTo(TimeLayer3D *dest)
 		{
 			switch( hw )
@@ -690,10 +840,10 @@ template <typename T, SwipeType swipe>
 				switch( dest->hw )
 				{
 				case CPU:
-					memcpy(dest->U->getArray() + dest->haloSize, U->getArray() + haloSize, dimx * dimy * dimz * sizeof(FTYPE));
-					memcpy(dest->V->getArray() + dest->haloSize, V->getArray() + haloSize, dimx * dimy * dimz * sizeof(FTYPE));
-					memcpy(dest->W->getArray() + dest->haloSize, W->getArray() + haloSize, dimx * dimy * dimz * sizeof(FTYPE));
-					memcpy(dest->T->getArray() + dest->haloSize, T->getArray() + haloSize, dimx * dimy * dimz * sizeof(FTYPE));
+					CopyArray(dest->U->getArray() + dest->haloSize, U->getArray() + haloSize, dimx * dimy * dimz);
+					CopyArray(dest->V->getArray() + dest->haloSize, V->getArray() + haloSize, dimx * dimy * dimz);
+					CopyArray(dest->W->getArray() + dest->haloSize, W->getArray() + haloSize, dimx * dimy * dimz);
+					CopyArray(dest->T->getArray() + dest->haloSize, T->getArray() + haloSize, dimx * dimy * dimz);
 					return;
 				case GPU:
 					multiDevMemcpy<FTYPE>(dest->U->getMultiArray(), U->getArray() + haloSize, dimx * dimy * dimz, haloSize); 
@@ -723,6 +873,41 @@ template <typename T, SwipeType swipe>
 			}
 		}
 
+		// whole layer copy, on CPU only the wet bricks: the dry nodes of a CPU layer are never read
+		void CopyLayerTo(Grid3D *grid, TimeLayer3D *dest)
+		{
+			if (hw != CPU || dest->hw != CPU)
+			{
+				CopyLayerTo(dest);
+				return;
+			}
+
+			if (InParallelRegion())
+				CopyLayerTo_CPU(grid, dest);
+			else
+			{
+				#pragma omp parallel default(none) shared(grid, dest)
+				CopyLayerTo_CPU(grid, dest);
+			}
+		}
+
+		void CopyLayerTo_CPU(Grid3D *grid, TimeLayer3D *dest)
+		{
+			ScalarField3D *src_fields[4] = { U, V, W, T };
+			ScalarField3D *dest_fields[4] = { dest->U, dest->V, dest->W, dest->T };
+			int numBricks = grid->GetNumWetBricks();
+			#pragma omp for
+			for (int n = 0; n < numBricks; n++)
+			{
+				int i0, i1, j0, j1, k0, k1;
+				grid->GetBrickRange(n, i0, i1, j0, j1, k0, k1);
+				for (int f = 0; f < 4; f++)
+					for (int i = i0; i < i1; i++)
+						for (int j = j0; j < j1; j++)
+							memcpy(&dest_fields[f]->elem(i, j, k0), &src_fields[f]->elem(i, j, k0), (k1 - k0) * sizeof(FTYPE));
+			}
+		}
+
 		void CopyLayerTo(Grid3D *grid, TimeLayer3D *dest, NodeType type)
 		{			
 			U->CopyFieldTo(grid, dest->U, type);
@@ -737,16 +922,21 @@ template <typename T, SwipeType swipe>
 			{
 			case CPU: 
 				{
-					for (int i = 0; i < dimx; i++)
-						for (int j = 0; j < dimy; j++)
-							for (int k = 0; k < dimz; k++)
-							{
-								Vec3D vel = grid->GetVel(i + dimxOffset, j, k);
-								U->elem(i, j, k) = vel.x;
-								V->elem(i, j, k) = vel.y;
-								W->elem(i, j, k) = vel.z;
-								T->elem(i, j, k) = (FTYPE)grid->GetT(i + dimxOffset, j, k);
-							}
+					for (int n = 0; n < grid->GetNumWetBricks(); n++)
+					{
+						int i0, i1, j0, j1, k0, k1;
+						grid->GetBrickRange(n, i0, i1, j0, j1, k0, k1);
+						for (int i = i0; i < i1; i++)
+							for (int j = j0; j < j1; j++)
+								for (int k = k0; k < k1; k++)
+								{
+									Vec3D vel = grid->GetVel(i + dimxOffset, j, k);
+									U->elem(i, j, k) = vel.x;
+									V->elem(i, j, k) = vel.y;
+									W->elem(i, j, k) = vel.z;
+									T->elem(i, j, k) = (FTYPE)grid->GetT(i + dimxOffset, j, k);
+								}
+					}
 					break;
 				}
 				case GPU:
@@ -816,7 +1006,8 @@ template <typename T, SwipeType swipe>
 			}
 		}
 
-		void FilterToArrays(Vec3D *outV, double *outT, int _outdimx, int outdimy, int outdimz)
+		// NODE_OUT samples are written as MISSING_VALUE
+		void FilterToArrays(Grid3D *grid, Vec3D *outV, double *outT, int _outdimx, int outdimy, int outdimz)
 		{
 			if (_outdimx == 0) _outdimx = dimx;
 			if (outdimy == 0) outdimy = dimy;
@@ -847,6 +1038,12 @@ template <typename T, SwipeType swipe>
 								int y = (j * dimy / outdimy);
 								int z = (k * dimz / outdimz);
 								int ind = i * outdimy * outdimz + j * outdimz + k;
+								if (grid->GetType(x + dimxOffset, y, z) == NODE_OUT)
+								{
+									outVx[ind] = outVy[ind] = outVz[ind] = MISSING_VALUE;
+									outT[ind] = (FTYPE)MISSING_VALUE;
+									continue;
+								}
 								outVx[ind] = U->elem(x, y, z); 
 								outVy[ind] = V->elem(x, y, z);
 								outVz[ind] = W->elem(x, y, z);
@@ -874,6 +1071,12 @@ template <typename T, SwipeType swipe>
 								int y = (j * dimy / outdimy);
 								int z = (k * dimz / outdimz);
 								int ind = i * outdimy * outdimz + j * outdimz + k;
+								if (grid->GetType(x + dimxOffset, y, z) == NODE_OUT)
+								{
+									outVx[ind] = outVy[ind] = outVz[ind] = MISSING_VALUE;
+									outT[ind] = (FTYPE)MISSING_VALUE;
+									continue;
+								}
 								outVx[ind] = u_cpu[x * dimy * dimz + y * dimz + z]; 
 								outVy[ind] = v_cpu[x * dimy * dimz + y * dimz + z]; 
 								outVz[ind] = w_cpu[x * dimy * dimz + y * dimz + z]; 
@@ -929,17 +1132,13 @@ template <typename T, SwipeType swipe>
 			{
 			case CPU:
 				{
-					for (int i = 0; i < dimx; i++)
-						for (int j = 0; j < dimy; j++)
-							for (int k = 0; k < dimz; k++)
-								if (grid->GetType(i + dimxOffset, j, k) == target)
-								{
-									Vec3D velocity = grid->GetVel(i + dimxOffset, j, k);
-									U->elem(i, j, k) = (FTYPE)velocity.x;
-									V->elem(i, j, k) = (FTYPE)velocity.y;
-									W->elem(i, j, k) = (FTYPE)velocity.z;
-									T->elem(i, j, k) = (FTYPE)grid->GetT(i + dimxOffset, j, k);
-								}
+					if (InParallelRegion())
+						CopyFromGrid_CPU(grid, target);
+					else
+					{
+						#pragma omp parallel default(none) firstprivate(target) shared(grid)
+						CopyFromGrid_CPU(grid, target);
+					}
 					break;
 				}
 			case GPU:
@@ -950,6 +1149,48 @@ template <typename T, SwipeType swipe>
 			}
 		}
 
+		void CopyFromGrid_CPU(Grid3D *grid, NodeType target)
+		{
+			if (target == NODE_BOUND || target == NODE_VALVE)
+			{
+				// walk the boundary records instead of scanning the volume
+				int numBound = grid->GetNumBoundNodes();
+				const int *indices = grid->GetBoundIndices();
+				const Node *bound = grid->GetBoundNodes();
+				#pragma omp for
+				for (int b = 0; b < numBound; b++)
+				{
+					if (bound[b].type != target) continue;
+					int i = indices[b] / (dimy * dimz) - dimxOffset;
+					if (i < 0 || i >= dimx) continue;
+					int j = (indices[b] / dimz) % dimy;
+					int k = indices[b] % dimz;
+					U->elem(i, j, k) = (FTYPE)bound[b].v.x;
+					V->elem(i, j, k) = (FTYPE)bound[b].v.y;
+					W->elem(i, j, k) = (FTYPE)bound[b].v.z;
+					T->elem(i, j, k) = (FTYPE)bound[b].T;
+				}
+				return;
+			}
+
+			#pragma omp for
+			for (int row = 0; row < dimx * dimy; row++)
+			{
+				int i = row / dimy, j = row % dimy, num;
+				const NodeSpan *spans = grid->GetRowSpans(i + dimxOffset, j, num);
+				for (int s = 0; s < num; s++)
+					if (spans[s].type == target)
+						for (int k = spans[s].k0; k < spans[s].k1; k++)
+						{
+							Vec3D velocity = grid->GetVel(i + dimxOffset, j, k);
+							U->elem(i, j, k) = (FTYPE)velocity.x;
+							V->elem(i, j, k) = (FTYPE)velocity.y;
+							W->elem(i, j, k) = (FTYPE)velocity.z;
+							T->elem(i, j, k) = (FTYPE)grid->GetT(i + dimxOffset, j, k);
+						}
+			}
+		}
+
 		void CopyGridBoundary(Grid3D *grid)
 		{
 			switch (hw)
@@ -977,16 +1218,13 @@ template <typename T, SwipeType swipe>
 			{
 			case CPU:
 				{
-					for (int i = 0; i < dimx; i++)
-						for (int j = 0; j < dimy; j++)
-							for (int k = 0; k < dimz; k++)
-								if (grid->GetType(i + dimxOffset, j, k) == target)
-								{
-									U->elem(i, j, k) = const_u;
-									V->elem(i, j, k) = const_v;
-									W->elem(i, j, k) = const_w;
-									T->elem(i, j, k) = const_T;
-								}
+					if (InParallelRegion())
+						Clear_CPU(grid, target, const_u, const_v, const_w, const_T);
+					else
+					{
+						#pragma omp parallel default(none) firstprivate(target, const_u, const_v, const_w, const_T) shared(grid)
+						Clear_CPU(grid, target, const_u, const_v, const_w, const_T);
+					}
 					break;
 				}
 			case GPU:
@@ -997,6 +1235,38 @@ template <typename T, SwipeType swipe>
 			}
 		}
 
+		void Clear_CPU(Grid3D *grid, NodeType target, FTYPE const_u, FTYPE const_v, FTYPE const_w, FTYPE const_T)
+		{
+			#pragma omp for
+			for (int row = 0; row < dimx * dimy; row++)
+			{
+				int i = row / dimy, j = row % dimy, num;
+				const NodeSpan *spans = grid->GetRowSpans(i + dimxOffset, j, num);
+				FTYPE *u_row = &U->elem(i, j, 0);
+				FTYPE *v_row = &V->elem(i, j, 0);
+				FTYPE *w_row = &W->elem(i, j, 0);
+				FTYPE *T_row = &T->elem(i, j, 0);
+				for (int s = 0; s < num; s++)
+					if (spans[s].type == target)
+						for (int k = spans[s].k0; k < spans[s].k1; k++)
+						{
+							u_row[k] = const_u;
+							v_row[k] = const_v;
+							w_row[k] = const_w;
+							T_row[k] = const_T;
+						}
+			}
+		}
+
+		// exchanges the storage of two layers of the same shape, no data is moved
+		void SwapFields(TimeLayer3D *layer)
+		{
+			swap(U, layer->U);
+			swap(V, layer->V);
+			swap(W, layer->W);
+			swap(T, layer->T);
+		}
+
 		void Transpose(TimeLayer3D *dest)
 		{
 			U->Transpose(dest->U);